@@ -0,0 +1,98 @@
+'''
+Measures how render throughput scales with the number of Python threads.
+
+Every thread gets its own Map, since zoom_to_box changes the map. Since
+render_to_file releases the GIL, throughput should grow with the number
+of threads up to the number of cores.
+
+Usage: python3 bench/render_threads.py [renders] [max_threads]
+'''
+
+import os, sys, json, time, random, tempfile, threading
+import pymapnik3
+
+SRS = '+init=epsg:4326'
+SIZE = 512
+FEATURES = 2000
+
+def make_features():
+    random.seed(1)
+    features = []
+    for ix in range(FEATURES):
+        x = random.uniform(-170, 170)
+        y = random.uniform(-80, 80)
+        d = random.uniform(0.5, 5)
+        ring = [[x, y], [x + d, y], [x + d, y + d], [x, y + d], [x, y]]
+        features.append(json.dumps({
+            'type' : 'Feature',
+            'geometry' : {'type' : 'Polygon', 'coordinates' : [ring]},
+            'properties' : {'id' : ix}
+        }))
+    return features
+
+def make_map(datasource):
+    symb = pymapnik3.PolygonSymbolizer()
+    symb.set_fill(pymapnik3.Color('#3366cc'))
+    symb.set_fill_opacity(0.5)
+    line = pymapnik3.LineSymbolizer()
+    line.set_stroke(pymapnik3.Color('#000000'))
+    line.set_stroke_width(0.5)
+
+    rule = pymapnik3.Rule()
+    rule.add_symbolizer(symb)
+    rule.add_symbolizer(line)
+    style = pymapnik3.Style()
+    style.add_rule(rule)
+
+    layer = pymapnik3.Layer('polygons')
+    layer.set_srs(SRS)
+    layer.set_datasource(datasource)
+    layer.add_style('polygons')
+
+    themap = pymapnik3.Map(SIZE, SIZE)
+    themap.set_srs(SRS)
+    themap.set_background(pymapnik3.Color('white'))
+    themap.add_style('polygons', style)
+    themap.add_layer(layer)
+    themap.zoom_to_box(pymapnik3.Box2d(-180, -90, 180, 90))
+    return themap
+
+def run(maps, renders, threads, outdir):
+    per_thread = renders // threads
+
+    def work(ix):
+        filename = os.path.join(outdir, 'tile-%s.png' % ix)
+        for _ in range(per_thread):
+            pymapnik3.render_to_file(maps[ix], filename, 'png')
+
+    workers = [threading.Thread(target = work, args = (ix, ))
+               for ix in range(threads)]
+    start = time.time()
+    for worker in workers:
+        worker.start()
+    for worker in workers:
+        worker.join()
+    return (per_thread * threads) / (time.time() - start)
+
+def main():
+    renders = int(sys.argv[1]) if len(sys.argv) > 1 else 64
+    max_threads = int(sys.argv[2]) if len(sys.argv) > 2 else os.cpu_count()
+
+    ctx = pymapnik3.Context()
+    datasource = pymapnik3.MemoryDatasource()
+    for feature in make_features():
+        datasource.add_feature(pymapnik3.parse_from_geojson(feature, ctx))
+
+    maps = [make_map(datasource) for _ in range(max_threads)]
+    with tempfile.TemporaryDirectory() as outdir:
+        base = None
+        threads = 1
+        while threads <= max_threads:
+            rate = run(maps, renders, threads, outdir)
+            base = base or rate
+            print('%3d threads: %7.1f renders/s  (%.2fx)' %
+                  (threads, rate, rate / base))
+            threads *= 2
+
+if __name__ == '__main__':
+    main()
@@ -3,6 +3,8 @@
 #include <Python.h>
 #include <structmember.h>
 
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 
 #include <mapnik/config.hpp>
@@ -20,36 +22,417 @@
 #include <mapnik/value_types.hpp>
 
 #include <mapnik/agg_renderer.hpp>
+#include <mapnik/attribute.hpp>
 #include <mapnik/box2d.hpp>
 #include <mapnik/color.hpp>
 #include <mapnik/config_error.hpp>
 #include <mapnik/datasource.hpp>
 #include <mapnik/datasource_cache.hpp>
+#include <mapnik/expression_evaluator.hpp>
 #include <mapnik/feature.hpp>
 #include <mapnik/feature_factory.hpp>
 #include <mapnik/feature_kv_iterator.hpp>
 #include <mapnik/feature_type_style.hpp>
+#include <mapnik/geometry.hpp>
 #include <mapnik/image_any.hpp>
+#include <mapnik/image_compositing.hpp>
 #include <mapnik/image_util.hpp>
+#include <mapnik/image_view.hpp>
+#include <mapnik/image_view_any.hpp>
+#include <mapnik/view_transform.hpp>
+#include <mapnik/well_known_srs.hpp>
 #include <mapnik/wkb.hpp>
+#include <mapnik/json/extract_bounding_boxes_x3.hpp>
 #include <mapnik/json/feature_parser.hpp>
+#include <mapnik/json/parse_feature.hpp>
+#include <mapnik/label_collision_detector.hpp>
 #include <mapnik/layer.hpp>
+#include <mapnik/load_map.hpp>
 #include <mapnik/map.hpp>
 #include <mapnik/memory_datasource.hpp>
+#include <mapnik/palette.hpp>
 #include <mapnik/projection.hpp>
 #include <mapnik/proj_transform.hpp>
+#include <mapnik/request.hpp>
+#include <mapnik/scale_denominator.hpp>
 #include <mapnik/text/placements/dummy.hpp>
 #include <mapnik/text/formatting/text.hpp>
 #include <mapnik/font_engine_freetype.hpp>
+#include <mapnik/unicode.hpp>
 
 #ifdef HAVE_CAIRO
-#include <mapnik/cairo_io.hpp>
+#include <mapnik/cairo/cairo_context.hpp>
+#include <mapnik/cairo/cairo_renderer.hpp>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
 
 static PyObject *MapnikError; // module exception
 
+// ===========================================================================
+// LOCKING
+
+// Renders run with the GIL released, so other Python threads could modify
+// a map while it's being rendered. To prevent that each map has a
+// reader/writer lock: renders hold it shared, methods that modify the map
+// hold it exclusively. Datasources can be shared between maps, so there is
+// one lock for all of them.
+
+typedef std::shared_timed_mutex RWLock;
+
+static RWLock datasource_lock;
+
+// Holds a lock exclusively for as long as the object lives. If the lock is
+// busy we wait with the GIL released, so that other Python threads aren't
+// stalled until the render holding the lock is done. A NULL lock is for
+// objects that aren't part of any map, and locks nothing.
+class ExclusiveLock {
+public:
+    ExclusiveLock(RWLock& lock) : lock_(lock, std::defer_lock)
+    {
+        acquire();
+    }
+
+    ExclusiveLock(RWLock* lock)
+    {
+        if (lock != NULL) {
+            lock_ = std::unique_lock<RWLock>(*lock, std::defer_lock);
+            acquire();
+        }
+    }
+
+private:
+    void acquire()
+    {
+        if (!lock_.try_lock()) {
+            Py_BEGIN_ALLOW_THREADS
+            lock_.lock();
+            Py_END_ALLOW_THREADS
+        }
+    }
+
+    std::unique_lock<RWLock> lock_;
+};
+
+// The same for holding a lock shared, for methods that only read the map
+class SharedLock {
+public:
+    SharedLock(RWLock* lock)
+    {
+        if (lock != NULL) {
+            lock_ = std::shared_lock<RWLock>(*lock, std::defer_lock);
+            if (!lock_.try_lock()) {
+                Py_BEGIN_ALLOW_THREADS
+                lock_.lock();
+                Py_END_ALLOW_THREADS
+            }
+        }
+    }
+
+private:
+    std::shared_lock<RWLock> lock_;
+};
+
+// Holds one lock exclusively and another shared, for copying from the
+// object of the second into that of the first. The locks are taken in
+// order of address, so that two copies in opposite directions can't
+// deadlock, and waited for with the GIL released. A NULL lock is skipped,
+// and so is the second if both are the same, as the locks aren't
+// recursive.
+class CopyLock {
+public:
+    CopyLock(RWLock* target, RWLock* source)
+    {
+        if (target != NULL)
+            target_ = std::unique_lock<RWLock>(*target, std::defer_lock);
+        if (source != NULL && source != target)
+            source_ = std::shared_lock<RWLock>(*source, std::defer_lock);
+        if (!try_acquire()) {
+            Py_BEGIN_ALLOW_THREADS
+            acquire();
+            Py_END_ALLOW_THREADS
+        }
+    }
+
+private:
+    bool try_acquire()
+    {
+        if (target_.mutex() != NULL && !target_.try_lock())
+            return false;
+        if (source_.mutex() != NULL && !source_.try_lock()) {
+            if (target_.owns_lock())
+                target_.unlock();
+            return false;
+        }
+        return true;
+    }
+
+    void acquire()
+    {
+        if (source_.mutex() != NULL && target_.mutex() != NULL &&
+            std::less<RWLock*>()(source_.mutex(), target_.mutex())) {
+            source_.lock();
+            target_.lock();
+            return;
+        }
+        if (target_.mutex() != NULL)
+            target_.lock();
+        if (source_.mutex() != NULL)
+            source_.lock();
+    }
+
+    std::unique_lock<RWLock> target_;
+    std::shared_lock<RWLock> source_;
+};
+
+// ===========================================================================
+// EXPRESSION CACHE
+
+// Generated stylesheets repeat the same filters and text names many times,
+// so parsed expressions are cached by their text. Mapnik never modifies an
+// expression once parsed, so everyone using the same text can share it.
+
+static const std::size_t EXPRESSION_CACHE_SIZE = 10000;
+
+static std::mutex expression_cache_lock;
+static std::unordered_map<std::string, mapnik::expression_ptr> expression_cache;
+static std::size_t expression_cache_hits = 0;
+static std::size_t expression_cache_misses = 0;
+
+// Throws like parse_expression if the text isn't a valid expression
+static mapnik::expression_ptr
+cached_expression(std::string const& text)
+{
+    {
+        std::lock_guard<std::mutex> guard(expression_cache_lock);
+        auto it = expression_cache.find(text);
+        if (it != expression_cache.end()) {
+            expression_cache_hits++;
+            return it->second;
+        }
+        expression_cache_misses++;
+    }
+
+    // parsing happens without the lock, so two threads may parse the same
+    // text at once, in which case the first one to finish is kept
+    mapnik::expression_ptr expr = mapnik::parse_expression(text);
+
+    std::lock_guard<std::mutex> guard(expression_cache_lock);
+    if (expression_cache.size() >= EXPRESSION_CACHE_SIZE)
+        return expr;
+    return expression_cache.emplace(text, expr).first->second;
+}
+
+// ===========================================================================
+// EXTENT CACHE
+
+// Asking a datasource for its envelope can mean reading through all of its
+// data, and tile renders ask for the envelope of every layer. Envelopes
+// stored by Map.cache_layer_extents are kept here, where those renders
+// find them, until Map.clear_layer_extents is called or, for a
+// MemoryDatasource, features are added. Entries are keyed by address and
+// hold the datasource weakly, so that a datasource allocated where a freed
+// one was isn't taken for it.
+
+struct CachedExtent {
+    std::weak_ptr<mapnik::datasource> source;
+    mapnik::box2d<double> extent;
+};
+
+static std::mutex extent_cache_lock;
+static std::unordered_map<mapnik::datasource const*, CachedExtent> extent_cache;
+
+// Stores the envelopes, replacing any already there, and drops the entries
+// of datasources that no longer exist
+static void
+cache_extents(std::vector<std::pair<mapnik::datasource_ptr, mapnik::box2d<double>>> const& extents)
+{
+    std::lock_guard<std::mutex> guard(extent_cache_lock);
+    for (auto it = extent_cache.begin(); it != extent_cache.end(); ) {
+        if (it->second.source.expired())
+            it = extent_cache.erase(it);
+        else
+            ++it;
+    }
+    for (auto const& entry : extents)
+        extent_cache[entry.first.get()] = CachedExtent{entry.first, entry.second};
+}
+
+static bool
+cached_extent(mapnik::datasource_ptr const& source, mapnik::box2d<double>& extent)
+{
+    std::lock_guard<std::mutex> guard(extent_cache_lock);
+    auto it = extent_cache.find(source.get());
+    if (it == extent_cache.end() || it->second.source.lock() != source)
+        return false;
+    extent = it->second.extent;
+    return true;
+}
+
+static void
+forget_extent(mapnik::datasource const* source)
+{
+    std::lock_guard<std::mutex> guard(extent_cache_lock);
+    extent_cache.erase(source);
+}
+
+// Sets extent to the extent of the layer's data, in the layer's
+// projection, if that's known without asking the datasource: the layer's
+// maximum extent if it has one, otherwise the cached envelope
+static bool
+known_layer_extent(mapnik::layer const& lyr, mapnik::box2d<double>& extent)
+{
+    if (lyr.maximum_extent()) {
+        extent = *lyr.maximum_extent();
+        return true;
+    }
+    return cached_extent(lyr.datasource(), extent);
+}
+
+// The extent of the layer's data, in the layer's projection, asking the
+// datasource only if it isn't known otherwise
+static mapnik::box2d<double>
+layer_extent(mapnik::layer const& lyr)
+{
+    mapnik::box2d<double> extent;
+    if (known_layer_extent(lyr, extent))
+        return extent;
+    return lyr.datasource()->envelope();
+}
+
+// ===========================================================================
+// MAP STATE
+
+// A Map object doesn't own its mapnik map outright: clones share it, and
+// the first one to modify it gets a copy of its own. The size, extent and
+// buffer size, which is all a clone is expected to change, are kept
+// outside the mapnik map so that every clone has its own, and renders are
+// given them as a request. Handles to the styles and layers of a map point
+// at its state, so that edits through them also copy a shared map first.
+// The generation counts the times load_map has changed the styles and
+// layers, so that handles taken before then stop working instead of
+// silently picking up a new style or layer of the same name.
+
+// Grows the box so that it has the same aspect ratio as the image, the
+// way Map::zoom_to_box does
+static mapnik::box2d<double>
+fit_aspect(mapnik::box2d<double> box, unsigned width, unsigned height)
+{
+    double ratio = double(width) / height;
+    if (box.width() / box.height() > ratio)
+        box.height(box.width() / ratio);
+    else
+        box.width(box.height() * ratio);
+    return box;
+}
+
+struct MapState {
+    std::shared_ptr<mapnik::Map> map;
+    RWLock lock;
+    unsigned width;
+    unsigned height;
+    mapnik::box2d<double> extent;
+    int buffer_size;
+    unsigned generation;
+
+    MapState(unsigned width, unsigned height)
+        : map(std::make_shared<mapnik::Map>(width, height)),
+          width(width), height(height),
+          extent(map->get_current_extent()),
+          buffer_size(map->buffer_size()),
+          generation(0)
+    {
+    }
+
+    // A clone: the same mapnik map and view, with a lock of its own. Must
+    // be called with the lock of the original held.
+    explicit MapState(MapState const& other)
+        : map(other.map),
+          width(other.width), height(other.height),
+          extent(other.extent),
+          buffer_size(other.buffer_size),
+          generation(0)
+    {
+    }
+
+    // The mapnik map, for modifying it. If it's shared with a clone, this
+    // first makes a copy. Must be called with the lock held exclusively.
+    mapnik::Map& writable()
+    {
+        if (map.use_count() > 1) {
+            map = std::make_shared<mapnik::Map>(*map);
+            sync_view();
+        }
+        return *map;
+    }
+
+    // Copies the view into the mapnik map if nobody else shares it, so that
+    // the few renders that can't be given a request find it there. Must be
+    // called with the lock held exclusively.
+    void sync_view()
+    {
+        if (map.use_count() > 1)
+            return;
+        map->resize(width, height);
+        map->set_buffer_size(buffer_size);
+        if (extent.valid())
+            map->zoom_to_box(extent);
+    }
+
+    mapnik::request view() const
+    {
+        mapnik::request req(width, height, extent);
+        req.set_buffer_size(buffer_size);
+        return req;
+    }
+};
+
+// The map with the view as its own size, extent and buffer size, for
+// renders that mapnik only does at the map's own, such as those with a
+// label collision detector. That's the map itself unless it's shared with
+// a clone that has a different view, in which case it's a copy.
+static mapnik::Map const&
+map_with_view(mapnik::Map const& map, mapnik::request const& view,
+              std::unique_ptr<mapnik::Map>& copy)
+{
+    if (map.width() == view.width() && map.height() == view.height() &&
+        map.buffer_size() == view.buffer_size() &&
+        map.get_current_extent() == view.extent())
+        return map;
+
+    copy.reset(new mapnik::Map(map));
+    copy->resize(view.width(), view.height());
+    copy->set_buffer_size(view.buffer_size());
+    if (view.extent().valid())
+        copy->zoom_to_box(view.extent());
+    return *copy;
+}
+
 // ===========================================================================
 // BOX2D
 
@@ -421,7 +804,7 @@ ShieldSymbolizer_set_name_expression(MapnikShieldSymbolizer *self, PyObject *arg
         return NULL;
 
     try {
-        self->placements->defaults.set_format_tree(std::make_shared<mapnik::formatting::text_node>(mapnik::parse_expression(expr)));
+        self->placements->defaults.set_format_tree(std::make_shared<mapnik::formatting::text_node>(cached_expression(expr)));
     } catch (std::exception e) {
         // FIXME: we can't say what the error is, because config_error.what()
         // doesn't get compiled into the mapnik library (??!?!)
@@ -571,7 +954,7 @@ TextSymbolizer_set_name_expression(MapnikTextSymbolizer *self, PyObject *args)
         return NULL;
 
     try {
-        self->placements->defaults.set_format_tree(std::make_shared<mapnik::formatting::text_node>(mapnik::parse_expression(expr)));
+        self->placements->defaults.set_format_tree(std::make_shared<mapnik::formatting::text_node>(cached_expression(expr)));
     } catch (std::exception e) {
         // FIXME: we can't say what the error is, because config_error.what()
         // doesn't get compiled into the mapnik library (??!?!)
@@ -685,7 +1068,12 @@ Expression_init(MapnikExpression *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "s", &c_expr))
         return -1;
 
-    self->expression = mapnik::parse_expression(std::string(c_expr));
+    try {
+        self->expression = cached_expression(std::string(c_expr));
+    } catch (std::exception e) {
+        PyErr_SetString(MapnikError, "parse error in expression");
+        return -1;
+    }
     return 0;
 }
 
@@ -1362,18 +1750,55 @@ static PyTypeObject RasterSymbolizerType = {
 // ===========================================================================
 // RULE
 
+// Mapnik keeps rules, styles and layers by value inside their owners. To
+// avoid copying them, adding one to its owner moves it there, and the
+// Python object becomes a handle to it: an owner plus the rule's index,
+// the style's name, or the layer's index. Edits through the handle then
+// reach the map directly, and so take the lock of the map. Accessors are
+// told whether the caller is going to modify what they return, since a map
+// shared with a clone has to be copied first.
+
+struct MapnikStyle;
+static mapnik::feature_type_style* get_style(struct MapnikStyle* self, bool write);
+static RWLock* style_lock(struct MapnikStyle* self);
+
 typedef struct {
     PyObject_HEAD
-    mapnik::rule *rule;
+    mapnik::rule *rule;          // NULL once added to a style
+    struct MapnikStyle *owner;
+    std::size_t index;
 } MapnikRule;
 
 static void
 Rule_dealloc(MapnikRule *self)
 {
     delete self->rule;
+    Py_XDECREF((PyObject*) self->owner);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
+static mapnik::rule*
+get_rule(MapnikRule *self, bool write)
+{
+    if (self->owner == NULL)
+        return self->rule;
+
+    mapnik::feature_type_style* style = get_style(self->owner, write);
+    if (style == NULL)
+        return NULL;
+    if (self->index >= style->get_rules().size()) {
+        PyErr_SetString(MapnikError, "rule is no longer part of its style");
+        return NULL;
+    }
+    return &style->get_rules_nonconst()[self->index];
+}
+
+static RWLock*
+rule_lock(MapnikRule *self)
+{
+    return self->owner == NULL ? NULL : style_lock(self->owner);
+}
+
 static int
 Rule_init(MapnikRule *self, PyObject *args)
 {
@@ -1388,24 +1813,29 @@ static PyMemberDef Rule_members[] = {
 static PyObject *
 Rule_add_symbolizer(MapnikRule *self, PyObject *symbolizer)
 {
+    ExclusiveLock lock(rule_lock(self));
+    mapnik::rule* rule = get_rule(self, true);
+    if (rule == NULL)
+        return NULL;
+
     if (PyObject_IsInstance(symbolizer, (PyObject*) &PolygonSymbolizerType)) {
         MapnikPolygonSymbolizer* oursymb = (MapnikPolygonSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else if (PyObject_IsInstance(symbolizer, (PyObject*) &LineSymbolizerType)) {
         MapnikLineSymbolizer* oursymb = (MapnikLineSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else if (PyObject_IsInstance(symbolizer, (PyObject*) &PointSymbolizerType)) {
         MapnikPointSymbolizer* oursymb = (MapnikPointSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else if (PyObject_IsInstance(symbolizer, (PyObject*) &RasterSymbolizerType)) {
         MapnikRasterSymbolizer* oursymb = (MapnikRasterSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else if (PyObject_IsInstance(symbolizer, (PyObject*) &TextSymbolizerType)) {
         MapnikTextSymbolizer* oursymb = (MapnikTextSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else if (PyObject_IsInstance(symbolizer, (PyObject*) &ShieldSymbolizerType)) {
         MapnikShieldSymbolizer* oursymb = (MapnikShieldSymbolizer*) symbolizer;
-        self->rule->append(*oursymb->symbolizer);
+        rule->append(*oursymb->symbolizer);
     } else {
         PyErr_SetString(MapnikError, "add_symbolizer requires a symbolizer object");
         return NULL;
@@ -1422,8 +1852,45 @@ Rule_set_filter(MapnikRule *self, PyObject *arg)
     }
 
     MapnikExpression* expr = (MapnikExpression*) arg;
-    self->rule->set_filter(expr->expression);
+    ExclusiveLock lock(rule_lock(self));
+    mapnik::rule* rule = get_rule(self, true);
+    if (rule == NULL)
+        return NULL;
+
+    rule->set_filter(expr->expression);
+
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Rule_set_max_scale(MapnikRule *self, PyObject *args)
+{
+    double scale;
+    if (!PyArg_ParseTuple(args, "d", &scale))
+        return NULL;
+
+    ExclusiveLock lock(rule_lock(self));
+    mapnik::rule* rule = get_rule(self, true);
+    if (rule == NULL)
+        return NULL;
 
+    rule->set_max_scale(scale);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Rule_set_min_scale(MapnikRule *self, PyObject *args)
+{
+    double scale;
+    if (!PyArg_ParseTuple(args, "d", &scale))
+        return NULL;
+
+    ExclusiveLock lock(rule_lock(self));
+    mapnik::rule* rule = get_rule(self, true);
+    if (rule == NULL)
+        return NULL;
+
+    rule->set_min_scale(scale);
     return Py_BuildValue("");
 }
 
@@ -1434,6 +1901,12 @@ static PyMethodDef Rule_methods[] = {
     {"set_filter", (PyCFunction) Rule_set_filter, METH_O,
      "Set a filter on the rule"
     },
+    {"set_max_scale", (PyCFunction) Rule_set_max_scale, METH_VARARGS,
+     "Set the scale denominator at or above which the rule is not used"
+    },
+    {"set_min_scale", (PyCFunction) Rule_set_min_scale, METH_VARARGS,
+     "Set the scale denominator below which the rule is not used"
+    },
     {NULL}  /* Sentinel */
 };
 
@@ -1508,18 +1981,49 @@ static PyTypeObject ShapefileType = {
 // ===========================================================================
 // STYLE
 
-typedef struct {
+typedef struct MapnikStyle {
     PyObject_HEAD
-    mapnik::feature_type_style *style;
+    mapnik::feature_type_style *style;  // NULL once added to a map
+    PyObject *owner;
+    MapState *state;
+    unsigned generation;
+    std::string *name;
 } MapnikStyle;
 
 static void
 Style_dealloc(MapnikStyle *self)
 {
     delete self->style;
+    delete self->name;
+    Py_XDECREF(self->owner);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
+static mapnik::feature_type_style*
+get_style(MapnikStyle *self, bool write)
+{
+    if (self->owner == NULL)
+        return self->style;
+
+    if (self->generation != self->state->generation) {
+        PyErr_SetString(MapnikError, "style is no longer part of its map");
+        return NULL;
+    }
+    mapnik::Map& map = write ? self->state->writable() : *self->state->map;
+    auto it = map.styles().find(*self->name);
+    if (it == map.styles().end()) {
+        PyErr_SetString(MapnikError, "style is no longer part of its map");
+        return NULL;
+    }
+    return &it->second;
+}
+
+static RWLock*
+style_lock(MapnikStyle *self)
+{
+    return self->state == NULL ? NULL : &self->state->lock;
+}
+
 static int
 Style_init(MapnikStyle *self, PyObject *args)
 {
@@ -1540,112 +2044,925 @@ Style_add_rule(MapnikStyle *self, PyObject *rule)
     }
 
     MapnikRule* ourrule = (MapnikRule*) rule;
-    self->style->add_rule(mapnik::rule(*ourrule->rule));
-    return Py_BuildValue("");
-}
-
-static PyMethodDef Style_methods[] = {
-    {"add_rule", (PyCFunction) Style_add_rule, METH_O,
-     "Add a rule to the style"
-    },
-    {NULL}  /* Sentinel */
-};
-
-static PyTypeObject StyleType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pymapnik3.Style",
-    .tp_doc = PyDoc_STR("Style objects"),
-    .tp_basicsize = sizeof(MapnikStyle),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Style_init,
-    .tp_dealloc = (destructor) Style_dealloc,
-    .tp_members = Style_members,
-    .tp_methods = Style_methods,
-};
-
+    CopyLock lock(style_lock(self), rule_lock(ourrule));
+    mapnik::feature_type_style* style = get_style(self, true);
+    if (style == NULL)
+        return NULL;
 
-// ===========================================================================
-// MEMORY DATASOURCE
+    if (ourrule->owner != NULL) {
+        // already part of a style, which keeps it, so this one is a copy
+        mapnik::rule* existing = get_rule(ourrule, false);
+        if (existing == NULL)
+            return NULL;
+        style->add_rule(mapnik::rule(*existing));
+        return Py_BuildValue("");
+    }
 
-typedef struct {
-    PyObject_HEAD
-    std::shared_ptr<mapnik::memory_datasource> source;
-} MapnikMemoryDatasource;
+    style->add_rule(std::move(*ourrule->rule));
+    delete ourrule->rule;
+    ourrule->rule = NULL;
+    Py_INCREF(self);
+    ourrule->owner = self;
+    ourrule->index = style->get_rules().size() - 1;
+    return Py_BuildValue("");
+}
 
-static void
-MemoryDatasource_dealloc(MapnikMemoryDatasource *self)
+static bool
+filter_mode_from_name(std::string const& name, mapnik::filter_mode_enum& out)
 {
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    if (name == "all")
+        out = mapnik::FILTER_ALL;
+    else if (name == "first")
+        out = mapnik::FILTER_FIRST;
+    else {
+        PyErr_Format(MapnikError, "unknown filter mode '%s'", name.c_str());
+        return false;
+    }
+    return true;
 }
 
-static int
-MemoryDatasource_init(MapnikMemoryDatasource *self, PyObject *args)
+static bool
+comp_op_from_name(std::string const& name, mapnik::composite_mode_e& out)
 {
-    mapnik::parameters params;
-    params[std::string("type")] = std::string("memory");
+    boost::optional<mapnik::composite_mode_e> comp_op = mapnik::comp_op_from_string(name);
+    if (!comp_op) {
+        PyErr_Format(MapnikError, "unknown comp_op '%s'", name.c_str());
+        return false;
+    }
+    out = *comp_op;
+    return true;
+}
 
-    self->source = std::make_shared<mapnik::memory_datasource>(params);
-    return 0;
+// Style.from_spec builds a whole style from a dict in one call, rather than
+// one call per property. A spec looks like
+//
+//   {"rules": [{"filter": "[type] = 'road'", "max_scale": 50000,
+//               "symbolizers": [{"type": "line", "stroke": "#000",
+//                                "stroke_width": 1.5}]}]}
+//
+// The style itself may also have filter_mode, opacity and comp_op. Symbolizer
+// properties have the names of the set_ methods, without "set_".
+// Colors are given as strings, and a raster colorizer as a dict with the
+// mode, color and stops of a RasterColorizer.
+
+static bool
+spec_double(PyObject* value, double& out)
+{
+    out = PyFloat_AsDouble(value);
+    return !(out == -1.0 && PyErr_Occurred());
 }
 
-static PyMemberDef MemoryDatasource_members[] = {
-    {NULL}  /* Sentinel */
-};
+static bool
+spec_string(PyObject* value, std::string& out)
+{
+    const char* c_value = PyUnicode_AsUTF8(value);
+    if (c_value == NULL)
+        return false;
+    out = c_value;
+    return true;
+}
 
-static PyObject *
-MemoryDatasource_add_feature(MapnikMemoryDatasource *self, PyObject* args)
+static bool
+spec_color(PyObject* value, mapnik::color& out)
 {
-    PyObject* obj;
-    if (!PyArg_ParseTuple(args, "O", &obj))
-        return NULL;
+    std::string colorspec;
+    if (!spec_string(value, colorspec))
+        return false;
 
-    if (!PyObject_IsInstance(obj, (PyObject*) &FeatureType)) {
-        PyErr_SetString(MapnikError, "add_feature requires a feature object");
-        return NULL;
+    try {
+        out = mapnik::color(colorspec);
+    } catch (const std::exception& ex) {
+        PyErr_SetString(MapnikError, ex.what());
+        return false;
     }
-
-    MapnikFeature *feature = (MapnikFeature*) obj;
-    self->source->push(feature->feature);
-    return Py_BuildValue("");
+    return true;
 }
 
-static PyMethodDef MemoryDatasource_methods[] = {
-    {"add_feature", (PyCFunction) MemoryDatasource_add_feature, METH_VARARGS,
-     "Add a feature to the data source"
-    },
-    {NULL}  /* Sentinel */
-};
+static bool
+spec_expression(PyObject* value, mapnik::expression_ptr& out)
+{
+    std::string text;
+    if (!spec_string(value, text))
+        return false;
 
-static PyTypeObject MemoryDatasourceType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pymapnik3.MemoryDatasource",
-    .tp_doc = PyDoc_STR("MemoryDatasource objects"),
-    .tp_basicsize = sizeof(MapnikMemoryDatasource),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) MemoryDatasource_init,
-    .tp_dealloc = (destructor) MemoryDatasource_dealloc,
-    .tp_members = MemoryDatasource_members,
-    .tp_methods = MemoryDatasource_methods,
-};
+    try {
+        out = cached_expression(text);
+    } catch (std::exception e) {
+        PyErr_Format(MapnikError, "parse error in expression '%s'", text.c_str());
+        return false;
+    }
+    return true;
+}
 
+static bool
+spec_list(PyObject* value, const char* key)
+{
+    if (!PyList_Check(value)) {
+        PyErr_Format(MapnikError, "'%s' must be a list", key);
+        return false;
+    }
+    return true;
+}
 
-// ===========================================================================
-// LAYER
+static bool
+spec_dict(PyObject* value, const char* what)
+{
+    if (!PyDict_Check(value)) {
+        PyErr_Format(MapnikError, "%s must be a dict", what);
+        return false;
+    }
+    return true;
+}
 
-typedef struct {
-    PyObject_HEAD
-    mapnik::layer* layer;
-} MapnikLayer;
+static bool
+spec_unknown(const char* what, std::string const& key)
+{
+    PyErr_Format(MapnikError, "%s has no property '%s'", what, key.c_str());
+    return false;
+}
 
+template <typename T>
 static void
-Layer_dealloc(MapnikLayer *self)
+spec_put(mapnik::symbolizer_base& symbolizer, mapnik::keys key, T const& value)
 {
-    delete self->layer;
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    symbolizer.properties.insert(std::pair<mapnik::keys, T>(key, value));
+}
+
+// The properties common to text and shield symbolizers. Sets known to
+// false if the key isn't one of them.
+static bool
+text_property_from_spec(mapnik::text_placements_ptr placements,
+                        std::string const& key, PyObject* value, bool& known)
+{
+    known = true;
+    mapnik::format_properties& format = placements->defaults.format_defaults;
+    if (key == "face_name")
+        return spec_string(value, format.face_name);
+    else if (key == "fill")
+        return spec_color(value, format.fill);
+    else if (key == "halo_fill")
+        return spec_color(value, format.halo_fill);
+    else if (key == "halo_radius")
+        return spec_double(value, format.halo_radius);
+    else if (key == "text_size")
+        return spec_double(value, format.text_size);
+    else if (key == "name_expression") {
+        mapnik::expression_ptr expr;
+        if (!spec_expression(value, expr))
+            return false;
+        placements->defaults.set_format_tree(std::make_shared<mapnik::formatting::text_node>(expr));
+        return true;
+    }
+    known = false;
+    return true;
+}
+
+static bool
+colorizer_from_spec(PyObject* spec, mapnik::raster_colorizer_ptr& out)
+{
+    if (!spec_dict(spec, "colorizer"))
+        return false;
+
+    PyObject* mode = PyDict_GetItemString(spec, "mode");
+    PyObject* color = PyDict_GetItemString(spec, "color");
+    PyObject* stops = PyDict_GetItemString(spec, "stops");
+    if (mode == NULL || color == NULL) {
+        PyErr_SetString(MapnikError, "colorizer requires mode and color");
+        return false;
+    }
+
+    mapnik::colorizer_mode_enum mmode = int_to_colorizer_mode(PyLong_AsLong(mode));
+    if (PyErr_Occurred())
+        return false;
+    if (mmode == mapnik::colorizer_mode_enum_MAX) {
+        PyErr_SetString(MapnikError, "unknown colorizer mode");
+        return false;
+    }
+    mapnik::color mcolor;
+    if (!spec_color(color, mcolor))
+        return false;
+
+    out = std::make_shared<mapnik::raster_colorizer>(mmode, mcolor);
+    if (stops == NULL)
+        return true;
+    if (!spec_list(stops, "stops"))
+        return false;
+
+    for (Py_ssize_t ix = 0; ix < PyList_GET_SIZE(stops); ix++) {
+        double limit;
+        PyObject* stopcolor;
+        if (!PyArg_Parse(PyList_GET_ITEM(stops, ix), "(dO)", &limit, &stopcolor))
+            return false;
+        if (!spec_color(stopcolor, mcolor))
+            return false;
+        out->add_stop(mapnik::colorizer_stop(limit, mapnik::COLORIZER_INHERIT, mcolor));
+    }
+    return true;
+}
+
+static bool
+symbolizer_from_spec(PyObject* spec, mapnik::rule& rule)
+{
+    if (!spec_dict(spec, "symbolizer"))
+        return false;
+
+    PyObject* type = PyDict_GetItemString(spec, "type");
+    std::string symtype;
+    if (type == NULL) {
+        PyErr_SetString(MapnikError, "symbolizer requires a type");
+        return false;
+    }
+    if (!spec_string(type, symtype))
+        return false;
+
+    mapnik::line_symbolizer line;
+    mapnik::polygon_symbolizer polygon;
+    mapnik::point_symbolizer point;
+    mapnik::raster_symbolizer raster;
+    mapnik::text_symbolizer text;
+    mapnik::shield_symbolizer shield;
+    mapnik::text_placements_ptr placements;
+
+    // text and shield symbolizers are set up as in TextSymbolizer_init
+    // and ShieldSymbolizer_init
+    if (symtype == "text" || symtype == "shield") {
+        placements = std::make_shared<mapnik::text_placements_dummy>();
+        if (symtype == "text")
+            spec_put(text, mapnik::keys::text_placements_, placements);
+        else {
+            spec_put(shield, mapnik::keys::text_placements_, placements);
+            spec_put(shield, mapnik::keys::unlock_image, true);
+        }
+    } else if (symtype != "line" && symtype != "polygon" &&
+               symtype != "point" && symtype != "raster") {
+        PyErr_Format(MapnikError, "unknown symbolizer type '%s'", symtype.c_str());
+        return false;
+    }
+    std::string what = symtype + " symbolizer";
+
+    Py_ssize_t pos = 0;
+    PyObject *pykey, *value;
+    while (PyDict_Next(spec, &pos, &pykey, &value)) {
+        std::string key;
+        if (!spec_string(pykey, key))
+            return false;
+        if (key == "type")
+            continue;
+
+        if (symtype == "line") {
+            if (key == "stroke") {
+                mapnik::color color;
+                if (!spec_color(value, color))
+                    return false;
+                spec_put(line, mapnik::keys::stroke, color);
+            } else if (key == "stroke_width") {
+                double width;
+                if (!spec_double(value, width))
+                    return false;
+                spec_put(line, mapnik::keys::stroke_width, width);
+            } else if (key == "stroke_dash") {
+                double length, gap;
+                if (!PyArg_Parse(value, "(dd)", &length, &gap))
+                    return false;
+                mapnik::dash_array da = { std::make_pair(length, gap) };
+                spec_put(line, mapnik::keys::stroke_dasharray, da);
+            } else
+                return spec_unknown(what.c_str(), key);
+
+        } else if (symtype == "polygon") {
+            if (key == "fill") {
+                mapnik::color color;
+                if (!spec_color(value, color))
+                    return false;
+                spec_put(polygon, mapnik::keys::fill, color);
+            } else if (key == "fill_opacity") {
+                double opacity;
+                if (!spec_double(value, opacity))
+                    return false;
+                spec_put(polygon, mapnik::keys::fill_opacity, opacity);
+            } else
+                return spec_unknown(what.c_str(), key);
+
+        } else if (symtype == "point") {
+            if (key == "file") {
+                std::string file;
+                if (!spec_string(value, file))
+                    return false;
+                spec_put(point, mapnik::keys::file, file);
+            } else if (key == "allow_overlap" || key == "ignore_placement") {
+                int flag = PyObject_IsTrue(value);
+                if (flag == -1)
+                    return false;
+                spec_put(point, key == "allow_overlap" ? mapnik::keys::allow_overlap
+                                                       : mapnik::keys::ignore_placement,
+                         flag == 1);
+            } else
+                return spec_unknown(what.c_str(), key);
+
+        } else if (symtype == "raster") {
+            if (key == "colorizer") {
+                mapnik::raster_colorizer_ptr colorizer;
+                if (!colorizer_from_spec(value, colorizer))
+                    return false;
+                spec_put(raster, mapnik::keys::colorizer, colorizer);
+            } else
+                return spec_unknown(what.c_str(), key);
+
+        } else {
+            bool known;
+            if (!text_property_from_spec(placements, key, value, known))
+                return false;
+            if (known)
+                continue;
+
+            if (symtype == "shield" && key == "file") {
+                std::string file;
+                if (!spec_string(value, file))
+                    return false;
+                spec_put(shield, mapnik::keys::file, file);
+            } else if (symtype == "shield" && key == "displacement") {
+                double x, y;
+                if (!PyArg_Parse(value, "(dd)", &x, &y))
+                    return false;
+                placements->defaults.layout_defaults.dx = x;
+                placements->defaults.layout_defaults.dy = y;
+            } else
+                return spec_unknown(what.c_str(), key);
+        }
+    }
+
+    if (symtype == "line")
+        rule.append(std::move(line));
+    else if (symtype == "polygon")
+        rule.append(std::move(polygon));
+    else if (symtype == "point")
+        rule.append(std::move(point));
+    else if (symtype == "raster")
+        rule.append(std::move(raster));
+    else if (symtype == "text")
+        rule.append(std::move(text));
+    else
+        rule.append(std::move(shield));
+    return true;
+}
+
+static bool
+rule_from_spec(PyObject* spec, mapnik::rule& rule)
+{
+    if (!spec_dict(spec, "rule"))
+        return false;
+
+    Py_ssize_t pos = 0;
+    PyObject *pykey, *value;
+    while (PyDict_Next(spec, &pos, &pykey, &value)) {
+        std::string key;
+        if (!spec_string(pykey, key))
+            return false;
+
+        if (key == "filter") {
+            mapnik::expression_ptr expr;
+            if (!spec_expression(value, expr))
+                return false;
+            rule.set_filter(expr);
+        } else if (key == "max_scale" || key == "min_scale") {
+            double scale;
+            if (!spec_double(value, scale))
+                return false;
+            if (key == "max_scale")
+                rule.set_max_scale(scale);
+            else
+                rule.set_min_scale(scale);
+        } else if (key == "symbolizers") {
+            if (!spec_list(value, "symbolizers"))
+                return false;
+            for (Py_ssize_t ix = 0; ix < PyList_GET_SIZE(value); ix++)
+                if (!symbolizer_from_spec(PyList_GET_ITEM(value, ix), rule))
+                    return false;
+        } else
+            return spec_unknown("rule", key);
+    }
+    return true;
+}
+
+static bool
+style_from_spec(PyObject* spec, mapnik::feature_type_style& style)
+{
+    if (!spec_dict(spec, "style spec"))
+        return false;
+
+    Py_ssize_t pos = 0;
+    PyObject *pykey, *value;
+    while (PyDict_Next(spec, &pos, &pykey, &value)) {
+        std::string key;
+        if (!spec_string(pykey, key))
+            return false;
+
+        if (key == "rules") {
+            if (!spec_list(value, "rules"))
+                return false;
+            for (Py_ssize_t ix = 0; ix < PyList_GET_SIZE(value); ix++) {
+                mapnik::rule rule;
+                if (!rule_from_spec(PyList_GET_ITEM(value, ix), rule))
+                    return false;
+                style.add_rule(std::move(rule));
+            }
+        } else if (key == "filter_mode") {
+            std::string name;
+            mapnik::filter_mode_enum mode;
+            if (!spec_string(value, name) || !filter_mode_from_name(name, mode))
+                return false;
+            style.set_filter_mode(mode);
+        } else if (key == "opacity") {
+            double opacity;
+            if (!spec_double(value, opacity))
+                return false;
+            style.set_opacity(opacity);
+        } else if (key == "comp_op") {
+            std::string name;
+            mapnik::composite_mode_e comp_op;
+            if (!spec_string(value, name) || !comp_op_from_name(name, comp_op))
+                return false;
+            style.set_comp_op(comp_op);
+        } else
+            return spec_unknown("style", key);
+    }
+    return true;
+}
+
+// A string spec is taken to be JSON
+static PyObject *
+Style_from_spec(PyObject *type, PyObject *spec)
+{
+    PyObject* parsed = NULL;
+    if (PyUnicode_Check(spec)) {
+        PyObject* json = PyImport_ImportModule("json");
+        if (json == NULL)
+            return NULL;
+        parsed = PyObject_CallMethod(json, "loads", "O", spec);
+        Py_DECREF(json);
+        if (parsed == NULL)
+            return NULL;
+        spec = parsed;
+    }
+
+    mapnik::feature_type_style style;
+    bool ok = style_from_spec(spec, style);
+    Py_XDECREF(parsed);
+    if (!ok)
+        return NULL;
+
+    PyObject* obj = PyObject_CallObject(type, NULL);
+    if (obj == NULL)
+        return NULL;
+    *((MapnikStyle*) obj)->style = std::move(style);
+    return obj;
+}
+
+static PyObject *
+Style_set_comp_op(MapnikStyle *self, PyObject *args)
+{
+    char *c_name;
+    if (!PyArg_ParseTuple(args, "s", &c_name))
+        return NULL;
+
+    mapnik::composite_mode_e comp_op;
+    if (!comp_op_from_name(std::string(c_name), comp_op))
+        return NULL;
+
+    ExclusiveLock lock(style_lock(self));
+    mapnik::feature_type_style* style = get_style(self, true);
+    if (style == NULL)
+        return NULL;
+
+    style->set_comp_op(comp_op);
+    return Py_BuildValue("");
+}
+
+// With "first" a feature is only rendered by the first rule whose filter
+// matches it, which saves evaluating the rest of the rules
+static PyObject *
+Style_set_filter_mode(MapnikStyle *self, PyObject *args)
+{
+    char *c_name;
+    if (!PyArg_ParseTuple(args, "s", &c_name))
+        return NULL;
+
+    mapnik::filter_mode_enum mode;
+    if (!filter_mode_from_name(std::string(c_name), mode))
+        return NULL;
+
+    ExclusiveLock lock(style_lock(self));
+    mapnik::feature_type_style* style = get_style(self, true);
+    if (style == NULL)
+        return NULL;
+
+    style->set_filter_mode(mode);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Style_set_opacity(MapnikStyle *self, PyObject *args)
+{
+    double opacity;
+    if (!PyArg_ParseTuple(args, "d", &opacity))
+        return NULL;
+
+    ExclusiveLock lock(style_lock(self));
+    mapnik::feature_type_style* style = get_style(self, true);
+    if (style == NULL)
+        return NULL;
+
+    style->set_opacity(opacity);
+    return Py_BuildValue("");
+}
+
+static PyMethodDef Style_methods[] = {
+    {"add_rule", (PyCFunction) Style_add_rule, METH_O,
+     "Add a rule to the style. Later changes to the rule apply to the style"
+    },
+    {"from_spec", (PyCFunction) Style_from_spec, METH_O | METH_CLASS,
+     "Build a new style from a dict, or a JSON string, of rules and symbolizers"
+    },
+    {"set_comp_op", (PyCFunction) Style_set_comp_op, METH_VARARGS,
+     "Set how the rendered style is composited onto the map, like 'multiply'"
+    },
+    {"set_filter_mode", (PyCFunction) Style_set_filter_mode, METH_VARARGS,
+     "Set whether features are rendered by 'all' matching rules, or only the 'first'"
+    },
+    {"set_opacity", (PyCFunction) Style_set_opacity, METH_VARARGS,
+     "Set the opacity of the rendered style (0.0-1.0)"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject StyleType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.Style",
+    .tp_doc = PyDoc_STR("Style objects"),
+    .tp_basicsize = sizeof(MapnikStyle),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Style_init,
+    .tp_dealloc = (destructor) Style_dealloc,
+    .tp_members = Style_members,
+    .tp_methods = Style_methods,
+};
+
+
+// ===========================================================================
+// MEMORY DATASOURCE
+
+typedef struct {
+    PyObject_HEAD
+    std::shared_ptr<mapnik::memory_datasource> source;
+    mapnik::value_integer max_id;  // the largest feature id added so far
+} MapnikMemoryDatasource;
+
+static void
+MemoryDatasource_dealloc(MapnikMemoryDatasource *self)
+{
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+MemoryDatasource_init(MapnikMemoryDatasource *self, PyObject *args)
+{
+    mapnik::parameters params;
+    params[std::string("type")] = std::string("memory");
+
+    self->source = std::make_shared<mapnik::memory_datasource>(params);
+    self->max_id = 0;
+    return 0;
+}
+
+static PyMemberDef MemoryDatasource_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+MemoryDatasource_add_feature(MapnikMemoryDatasource *self, PyObject* args)
+{
+    PyObject* obj;
+    if (!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+
+    if (!PyObject_IsInstance(obj, (PyObject*) &FeatureType)) {
+        PyErr_SetString(MapnikError, "add_feature requires a feature object");
+        return NULL;
+    }
+
+    MapnikFeature *feature = (MapnikFeature*) obj;
+    if (!feature->feature) {
+        PyErr_SetString(MapnikError, "add_feature can't add an empty feature");
+        return NULL;
+    }
+
+    ExclusiveLock lock(datasource_lock);
+    self->source->push(feature->feature);
+    self->max_id = std::max(self->max_id, feature->feature->id());
+    forget_extent(self->source.get());
+    return Py_BuildValue("");
+}
+
+// load_geojson parses a FeatureCollection the way mapnik's GeoJSON plugin
+// does: the collection is split into its features by mapnik's bounding box
+// extractor, which leaves out features without a geometry, and then each
+// feature is parsed in place. Mapnik's parsers don't read feature ids, so a
+// simple scanner picks those out. Ids must be integers, or strings holding
+// one; features without an id are numbered after the largest id in the
+// datasource and the collection.
+
+class GeoJsonScanner {
+public:
+    GeoJsonScanner(std::string const& text, std::size_t pos, std::size_t end)
+        : text_(text), pos_(pos), end_(end) {}
+
+    std::size_t pos() const { return pos_; }
+
+    bool at(char c)
+    {
+        skip_ws();
+        return pos_ < end_ && text_[pos_] == c;
+    }
+
+    bool expect(char c)
+    {
+        if (!at(c))
+            return false;
+        pos_++;
+        return true;
+    }
+
+    // escapes are left as they are, which is fine for the keys we look for
+    bool read_string(std::string& out)
+    {
+        std::size_t start = pos_ + 1;
+        if (!skip_string())
+            return false;
+        out = text_.substr(start, pos_ - start - 1);
+        return true;
+    }
+
+    bool skip_value()
+    {
+        skip_ws();
+        if (pos_ >= end_)
+            return false;
+        if (text_[pos_] == '"')
+            return skip_string();
+        if (text_[pos_] == '{' || text_[pos_] == '[') {
+            int depth = 0;
+            while (pos_ < end_) {
+                char c = text_[pos_];
+                if (c == '"') {
+                    if (!skip_string())
+                        return false;
+                    continue;
+                }
+                if (c == '{' || c == '[')
+                    depth++;
+                else if (c == '}' || c == ']')
+                    depth--;
+                pos_++;
+                if (depth == 0)
+                    return true;
+            }
+            return false;
+        }
+        while (pos_ < end_ && text_[pos_] != ',' && text_[pos_] != '}' &&
+               text_[pos_] != ']' && !std::isspace((unsigned char) text_[pos_]))
+            pos_++;
+        return true;
+    }
+
+    void skip_ws()
+    {
+        while (pos_ < end_ && std::isspace((unsigned char) text_[pos_]))
+            pos_++;
+    }
+
+private:
+    bool skip_string()
+    {
+        for (pos_++; pos_ < end_; pos_++) {
+            if (text_[pos_] == '\\')
+                pos_++;
+            else if (text_[pos_] == '"') {
+                pos_++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::string const& text_;
+    std::size_t pos_;
+    std::size_t end_;
+};
+
+enum FeatureIdKind { NO_ID, INTEGER_ID, OTHER_ID };
+
+// Looks for the id of the feature between start and end, and reads it if
+// it's an integer or a string holding one
+static FeatureIdKind
+feature_id(std::string const& text, std::size_t start, std::size_t end,
+           mapnik::value_integer& id)
+{
+    GeoJsonScanner scanner(text, start, end);
+    if (!scanner.expect('{'))
+        return NO_ID;
+
+    while (!scanner.at('}')) {
+        std::string key;
+        if (!scanner.at('"') || !scanner.read_string(key) || !scanner.expect(':'))
+            return NO_ID;
+
+        if (key == "id") {
+            scanner.skip_ws();
+            std::size_t value_start = scanner.pos();
+            if (!scanner.skip_value())
+                return OTHER_ID;
+            std::string value = text.substr(value_start, scanner.pos() - value_start);
+            if (value.size() > 1 && value[0] == '"')
+                value = value.substr(1, value.size() - 2);
+
+            char* endptr;
+            id = std::strtoll(value.c_str(), &endptr, 10);
+            return !value.empty() && *endptr == '\0' ? INTEGER_ID : OTHER_ID;
+        }
+        if (!scanner.skip_value())
+            return NO_ID;
+        if (!scanner.at('}') && !scanner.expect(','))
+            return NO_ID;
+    }
+    return NO_ID;
+}
+
+static bool
+read_file(std::string const& path, std::string& out)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    out = contents.str();
+    return true;
+}
+
+// The source is taken to be GeoJSON if it starts with '{', otherwise a
+// file name. Everything but adding the features to the datasource happens
+// with the GIL released.
+static PyObject *
+MemoryDatasource_load_geojson(MapnikMemoryDatasource *self, PyObject* args)
+{
+    char* c_source;
+    if (!PyArg_ParseTuple(args, "s", &c_source))
+        return NULL;
+
+    std::string source(c_source);
+    std::vector<mapnik::feature_ptr> features;
+    std::vector<bool> numbered;
+    mapnik::value_integer max_id = 0;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    std::string text;
+    std::size_t first = source.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && source[first] == '{')
+        text = std::move(source);
+    else if (!read_file(source, text))
+        error = "could not read " + source;
+
+    using Boxes = std::vector<std::pair<mapnik::box2d<double>, std::pair<std::uint64_t, std::uint64_t>>>;
+    Boxes boxes;
+    const char* begin = text.c_str();
+    if (error.empty()) {
+        try {
+            const char* start = begin;
+            mapnik::json::extract_bounding_boxes(start, begin + text.size(), boxes);
+        } catch (const std::exception& ex) {
+            error = "load_geojson requires a GeoJSON FeatureCollection";
+        }
+    }
+
+    mapnik::context_ptr ctx = std::make_shared<mapnik::context_type>();
+    mapnik::transcoder tr("utf8");
+    features.reserve(boxes.size());
+    for (std::size_t ix = 0; error.empty() && ix < boxes.size(); ix++) {
+        std::size_t offset = boxes[ix].second.first;
+        std::size_t size = boxes[ix].second.second;
+
+        mapnik::value_integer id = 0;
+        FeatureIdKind kind = feature_id(text, offset, offset + size, id);
+        if (kind == OTHER_ID) {
+            error = "geojson feature " + std::to_string(ix) + " has an id that isn't an integer";
+            break;
+        }
+        if (kind == INTEGER_ID)
+            max_id = std::max(max_id, id);
+
+        mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx, id));
+        try {
+            mapnik::json::parse_feature(begin + offset, begin + offset + size, *feature, tr);
+            features.push_back(feature);
+            numbered.push_back(kind == NO_ID);
+        } catch (const std::exception& ex) {
+            error = "Failed to parse geojson feature " + std::to_string(ix);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!error.empty()) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+
+    ExclusiveLock lock(datasource_lock);
+    max_id = std::max(max_id, self->max_id);
+    for (std::size_t ix = 0; ix < features.size(); ix++) {
+        if (numbered[ix])
+            features[ix]->set_id(++max_id);
+        self->source->push(features[ix]);
+    }
+    self->max_id = max_id;
+    forget_extent(self->source.get());
+    return Py_BuildValue("n", (Py_ssize_t) features.size());
+}
+
+static PyMethodDef MemoryDatasource_methods[] = {
+    {"add_feature", (PyCFunction) MemoryDatasource_add_feature, METH_VARARGS,
+     "Add a feature to the data source"
+    },
+    {"load_geojson", (PyCFunction) MemoryDatasource_load_geojson, METH_VARARGS,
+     "Add all features of a GeoJSON FeatureCollection, given as a string or a file name. Feature ids must be integers. Returns the number of features added"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject MemoryDatasourceType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.MemoryDatasource",
+    .tp_doc = PyDoc_STR("MemoryDatasource objects"),
+    .tp_basicsize = sizeof(MapnikMemoryDatasource),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) MemoryDatasource_init,
+    .tp_dealloc = (destructor) MemoryDatasource_dealloc,
+    .tp_members = MemoryDatasource_members,
+    .tp_methods = MemoryDatasource_methods,
+};
+
+
+// ===========================================================================
+// LAYER
+
+typedef struct {
+    PyObject_HEAD
+    mapnik::layer* layer;  // NULL once added to a map
+    PyObject *owner;
+    MapState *state;
+    unsigned generation;
+    std::size_t index;
+    std::string *name;
+} MapnikLayer;
+
+static void
+Layer_dealloc(MapnikLayer *self)
+{
+    delete self->layer;
+    delete self->name;
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// The generation and name are checked so that the handle doesn't silently
+// move to another layer if the layers of the map are replaced, as load_map
+// does.
+static mapnik::layer*
+get_layer(MapnikLayer *self, bool write)
+{
+    if (self->owner == NULL)
+        return self->layer;
+
+    mapnik::Map& map = *self->state->map;
+    if (self->generation != self->state->generation ||
+        self->index >= map.layers().size() ||
+        map.get_layer(self->index).name() != *self->name) {
+        PyErr_SetString(MapnikError, "layer is no longer part of its map");
+        return NULL;
+    }
+    if (write)
+        return &self->state->writable().get_layer(self->index);
+    return &map.get_layer(self->index);
+}
+
+static RWLock*
+layer_lock(MapnikLayer *self)
+{
+    return self->state == NULL ? NULL : &self->state->lock;
 }
 
 static int
@@ -1671,25 +2988,35 @@ Layer_add_style(MapnikLayer *self, PyObject* args)
     if (!PyArg_ParseTuple(args, "s", &style))
         return NULL;
 
-    self->layer->add_style(std::string(style));
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->add_style(std::string(style));
     return Py_BuildValue("");
 }
 
 static PyObject *
 Layer_set_datasource(MapnikLayer *self, PyObject *arg)
 {
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
     if (PyObject_IsInstance(arg, (PyObject*) &ShapefileType)) {
         MapnikShapefile* shapefile = (MapnikShapefile*) arg;
-        self->layer->set_datasource(shapefile->source);
+        layer->set_datasource(shapefile->source);
     } else if (PyObject_IsInstance(arg, (PyObject*) &MemoryDatasourceType)) {
         MapnikMemoryDatasource* memory = (MapnikMemoryDatasource*) arg;
-        self->layer->set_datasource(memory->source);
+        layer->set_datasource(memory->source);
     } else if (PyObject_IsInstance(arg, (PyObject*) &GdalType)) {
         MapnikGdal* gdal = (MapnikGdal*) arg;
-        self->layer->set_datasource(gdal->source);
+        layer->set_datasource(gdal->source);
     } else if (PyObject_IsInstance(arg, (PyObject*) &GeoJsonType)) {
         MapnikGeoJson* geojson = (MapnikGeoJson*) arg;
-        self->layer->set_datasource(geojson->source);
+        layer->set_datasource(geojson->source);
     } else {
         PyErr_SetString(MapnikError, "set_datasource requires a datasource object");
         return NULL;
@@ -1700,7 +3027,12 @@ Layer_set_datasource(MapnikLayer *self, PyObject *arg)
 static PyObject *
 Layer_get_srs(MapnikLayer *self, PyObject *Py_UNUSED(ignored))
 {
-    const char* c_srs = self->layer->srs().c_str();
+    SharedLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, false);
+    if (layer == NULL)
+        return NULL;
+
+    const char* c_srs = layer->srs().c_str();
     return Py_BuildValue("s", c_srs);
 }
 
@@ -1711,8 +3043,94 @@ Layer_set_clear_label_cache(MapnikLayer *self, PyObject* args)
     if (!PyArg_ParseTuple(args, "p", &flag))
         return NULL;
 
-    self->layer->set_clear_label_cache(flag == 1);
-    return Py_BuildValue("");
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_clear_label_cache(flag == 1);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Layer_set_buffer_size(MapnikLayer *self, PyObject* args)
+{
+    int size;
+    if (!PyArg_ParseTuple(args, "i", &size))
+        return NULL;
+
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_buffer_size(size);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Layer_set_maximum_extent(MapnikLayer *self, PyObject *box)
+{
+    if (!PyObject_IsInstance(box, (PyObject*) &BoxType)) {
+        PyErr_SetString(MapnikError, "set_maximum_extent requires a box object");
+        return NULL;
+    }
+
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_maximum_extent(*((MapnikBox2d*) box)->box);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Layer_set_maximum_scale_denominator(MapnikLayer *self, PyObject* args)
+{
+    double scale;
+    if (!PyArg_ParseTuple(args, "d", &scale))
+        return NULL;
+
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_maximum_scale_denominator(scale);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Layer_set_minimum_scale_denominator(MapnikLayer *self, PyObject* args)
+{
+    double scale;
+    if (!PyArg_ParseTuple(args, "d", &scale))
+        return NULL;
+
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_minimum_scale_denominator(scale);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Layer_set_queryable(MapnikLayer *self, PyObject* args)
+{
+    int flag;
+    if (!PyArg_ParseTuple(args, "p", &flag))
+        return NULL;
+
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_queryable(flag == 1);
+    return Py_BuildValue("");
 }
 
 static PyObject *
@@ -1722,7 +3140,12 @@ Layer_set_srs(MapnikLayer *self, PyObject* args)
     if (!PyArg_ParseTuple(args, "s", &c_srs))
         return NULL;
 
-    self->layer->set_srs(std::string(c_srs));
+    ExclusiveLock lock(layer_lock(self));
+    mapnik::layer* layer = get_layer(self, true);
+    if (layer == NULL)
+        return NULL;
+
+    layer->set_srs(std::string(c_srs));
     return Py_BuildValue("");
 }
 
@@ -1736,9 +3159,24 @@ static PyMethodDef Layer_methods[] = {
     {"set_datasource", (PyCFunction) Layer_set_datasource, METH_O,
      "Add underlying data source"
     },
+    {"set_buffer_size", (PyCFunction) Layer_set_buffer_size, METH_VARARGS,
+     "Set the buffer in pixels around the render extent to query, overriding the map's"
+    },
     {"set_clear_label_cache", (PyCFunction) Layer_set_clear_label_cache, METH_VARARGS,
      "Sets bool flag clear label cache"
     },
+    {"set_maximum_extent", (PyCFunction) Layer_set_maximum_extent, METH_O,
+     "Set the extent outside which the layer has no data"
+    },
+    {"set_maximum_scale_denominator", (PyCFunction) Layer_set_maximum_scale_denominator, METH_VARARGS,
+     "Set the scale denominator at or above which the layer isn't rendered"
+    },
+    {"set_minimum_scale_denominator", (PyCFunction) Layer_set_minimum_scale_denominator, METH_VARARGS,
+     "Set the scale denominator below which the layer isn't rendered"
+    },
+    {"set_queryable", (PyCFunction) Layer_set_queryable, METH_VARARGS,
+     "Set whether the layer can be queried for features"
+    },
     {"set_srs", (PyCFunction) Layer_set_srs, METH_VARARGS,
      "Set projection"
     },
@@ -1760,233 +3198,4195 @@ static PyTypeObject LayerType = {
 };
 
 
-// ===========================================================================
-// MAP
+// ===========================================================================
+// MAP
+
+typedef struct {
+    PyObject_HEAD
+    MapState* state;
+} MapnikMap;
+
+static void
+Map_dealloc(MapnikMap *self)
+{
+    delete self->state;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Map_init(MapnikMap *self, PyObject *args)
+{
+    int width, height;
+    if (!PyArg_ParseTuple(args, "ii", &width, &height))
+        return -1;
+
+    self->state = new MapState(width, height);
+
+    return 0;
+}
+
+static PyMemberDef Map_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+Map_add_layer(MapnikMap *self, PyObject* args)
+{
+    PyObject* obj;
+    if (!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+
+    if (!PyObject_IsInstance(obj, (PyObject*) &LayerType)) {
+        PyErr_SetString(MapnikError, "add_layer requires a layer object");
+        return NULL;
+    }
+
+    MapnikLayer *layer = (MapnikLayer *) obj;
+    CopyLock lock(&self->state->lock, layer_lock(layer));
+    mapnik::Map& map = self->state->writable();
+    if (layer->owner != NULL) {
+        // already part of a map, which keeps it, so this one is a copy
+        mapnik::layer* existing = get_layer(layer, false);
+        if (existing == NULL)
+            return NULL;
+        mapnik::layer copy(*existing);
+        map.add_layer(std::move(copy));
+        return Py_BuildValue("");
+    }
+
+    map.add_layer(std::move(*layer->layer));
+    delete layer->layer;
+    layer->layer = NULL;
+    Py_INCREF(self);
+    layer->owner = (PyObject*) self;
+    layer->state = self->state;
+    layer->generation = self->state->generation;
+    layer->index = map.layers().size() - 1;
+    layer->name = new std::string(map.layers().back().name());
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_add_style(MapnikMap *self, PyObject* args)
+{
+    char *c_name;
+    MapnikStyle *style;
+    if (!PyArg_ParseTuple(args, "sO", &c_name, &style))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) style, (PyObject*) &StyleType)) {
+        PyErr_SetString(MapnikError, "add_style requires a style object");
+        return NULL;
+    }
+
+    CopyLock lock(&self->state->lock, style_lock(style));
+    mapnik::Map& map = self->state->writable();
+    std::string name(c_name);
+    if (style->owner != NULL) {
+        // already part of a map, which keeps it, so this one is a copy
+        mapnik::feature_type_style* existing = get_style(style, false);
+        if (existing == NULL)
+            return NULL;
+        map.insert_style(name, *existing);
+        return Py_BuildValue("");
+    }
+
+    // like insert_style, the first style added with a name is kept
+    if (map.styles().count(name) > 0)
+        return Py_BuildValue("");
+
+    map.insert_style(name, std::move(*style->style));
+    delete style->style;
+    style->style = NULL;
+    Py_INCREF(self);
+    style->owner = (PyObject*) self;
+    style->state = self->state;
+    style->generation = self->state->generation;
+    style->name = new std::string(name);
+    return Py_BuildValue("");
+}
+
+// Parsing a large stylesheet is slow, so parsed stylesheets are kept in a
+// cache, keyed by file name, inode, size and modification time to the
+// nanosecond, or by the XML itself. Loading into a map copies the styles
+// and layers of the cached map. The symbolizers of the copies share the
+// parsed expressions, and the layers share the datasources, so the copy is
+// cheap. Once the cache is full the oldest entry makes way for the next.
+
+static const std::size_t MAP_CACHE_SIZE = 32;
+
+static std::mutex map_cache_lock;
+static std::map<std::string, std::shared_ptr<const mapnik::Map>> map_cache;
+static std::deque<std::string> map_cache_order;
+
+// Returns the parsed stylesheet, from the cache if it's there. Must be
+// called without the GIL.
+static std::shared_ptr<const mapnik::Map>
+parsed_map(std::string const& source, bool is_file, bool strict,
+           std::string const& base_path)
+{
+    std::ostringstream keystream;
+    keystream << strict << '|' << base_path << '|';
+    if (is_file) {
+        struct stat info;
+        if (stat(source.c_str(), &info) != 0)
+            throw std::runtime_error("could not open " + source);
+        keystream << "file|" << info.st_ino << '|' << info.st_size << '|'
+                  << info.st_mtim.tv_sec << '.' << info.st_mtim.tv_nsec << '|' << source;
+    } else {
+        keystream << "xml|" << source;
+    }
+    std::string key = keystream.str();
+
+    {
+        std::lock_guard<std::mutex> guard(map_cache_lock);
+        auto found = map_cache.find(key);
+        if (found != map_cache.end())
+            return found->second;
+    }
+
+    auto parsed = std::make_shared<mapnik::Map>();
+    if (is_file)
+        mapnik::load_map(*parsed, source, strict, base_path);
+    else
+        mapnik::load_map_string(*parsed, source, strict, base_path);
+
+    std::lock_guard<std::mutex> guard(map_cache_lock);
+    if (map_cache.emplace(key, parsed).second) {
+        map_cache_order.push_back(key);
+        if (map_cache_order.size() > MAP_CACHE_SIZE) {
+            map_cache.erase(map_cache_order.front());
+            map_cache_order.pop_front();
+        }
+    }
+    return parsed;
+}
+
+// Does to the map what load_map would have done: the map settings and
+// extra parameters are replaced, while styles, fontsets, fonts and layers
+// are added, keeping any existing style of the same name. The map's size
+// and extent are left alone.
+static void
+merge_map(mapnik::Map& map, mapnik::Map const& parsed)
+{
+    map.set_srs(parsed.srs());
+    if (parsed.background())
+        map.set_background(*parsed.background());
+    if (parsed.background_image()) {
+        map.set_background_image(*parsed.background_image());
+        map.set_background_image_comp_op(parsed.background_image_comp_op());
+        map.set_background_image_opacity(parsed.background_image_opacity());
+    }
+    map.set_buffer_size(parsed.buffer_size());
+    if (parsed.maximum_extent())
+        map.set_maximum_extent(*parsed.maximum_extent());
+    if (parsed.font_directory())
+        map.set_font_directory(*parsed.font_directory());
+    map.set_base_path(parsed.base_path());
+
+    for (auto const& param : parsed.get_extra_parameters())
+        map.get_extra_parameters()[param.first] = param.second;
+
+    for (auto const& style : parsed.styles())
+        map.insert_style(style.first, style.second);
+    for (auto const& fontset : parsed.fontsets())
+        map.insert_fontset(fontset.first, fontset.second);
+    for (mapnik::layer const& lyr : parsed.layers())
+        map.add_layer(lyr);
+
+    // The fonts registered on the parsed map can't be copied across, but
+    // registering their files again gives the same faces
+    std::set<std::string> font_files;
+    for (auto const& font : parsed.get_font_file_mapping())
+        font_files.insert(font.second.second);
+    for (std::string const& file : font_files)
+        map.register_fonts(file, false);
+    if (!parsed.get_font_memory_cache().empty())
+        map.load_fonts();
+}
+
+// Returns a map that shares the styles and layers of this one, with its
+// own size, extent and buffer size. Nothing is copied until one of the two
+// maps is modified other than by zooming, so that the clones can be zoomed
+// and rendered independently for next to nothing.
+static PyObject *
+Map_clone(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    MapnikMap* clone = (MapnikMap*) Py_TYPE(self)->tp_alloc(Py_TYPE(self), 0);
+    if (clone == NULL)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    std::shared_lock<RWLock> lock(self->state->lock);
+    clone->state = new MapState(*self->state);
+    Py_END_ALLOW_THREADS
+
+    return (PyObject*) clone;
+}
+
+// Asks the datasource of every layer for its envelope again and stores it
+// in the extent cache. The map itself isn't changed.
+static PyObject *
+Map_cache_layer_extents(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    MapState* state = self->state;
+    std::vector<std::pair<mapnik::datasource_ptr, mapnik::box2d<double>>> extents;
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        std::shared_lock<RWLock> lock(state->lock);
+        std::shared_lock<RWLock> dslock(datasource_lock);
+        for (mapnik::layer const& lyr : state->map->layers()) {
+            if (lyr.datasource())
+                extents.emplace_back(lyr.datasource(), lyr.datasource()->envelope());
+        }
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+    cache_extents(extents);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_clear_layer_extents(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    SharedLock lock(&self->state->lock);
+    for (mapnik::layer const& lyr : self->state->map->layers()) {
+        if (lyr.datasource())
+            forget_extent(lyr.datasource().get());
+    }
+    return Py_BuildValue("");
+}
+
+// Does what Map::scale_denominator does, at the map's own view
+static PyObject *
+Map_scale_denominator(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    double scale_denom = 0.0;
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        std::shared_lock<RWLock> lock(self->state->lock);
+        mapnik::projection proj(self->state->map->srs(), true);
+        scale_denom = mapnik::scale_denominator(self->state->view().scale(),
+                                                proj.is_geographic());
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+    return Py_BuildValue("d", scale_denom);
+}
+
+static PyObject *
+Map_set_background(MapnikMap *self, PyObject *color)
+{
+    if (!PyObject_IsInstance(color, (PyObject*) &ColorType)) {
+        PyErr_SetString(MapnikError, "set_background requires a color object");
+        return NULL;
+    }
+
+    MapnikColor* ourcolor = (MapnikColor*) color;
+    ExclusiveLock lock(self->state->lock);
+    self->state->writable().set_background(*ourcolor->color);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_get_srs(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    SharedLock lock(&self->state->lock);
+    const char* c_srs = self->state->map->srs().c_str();
+    return Py_BuildValue("s", c_srs);
+}
+
+static PyObject *
+Map_set_buffer_size(MapnikMap *self, PyObject* args)
+{
+    int size;
+    if (!PyArg_ParseTuple(args, "i", &size))
+        return NULL;
+
+    ExclusiveLock lock(self->state->lock);
+    self->state->buffer_size = size;
+    self->state->sync_view();
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_set_maximum_extent(MapnikMap *self, PyObject *box)
+{
+    if (!PyObject_IsInstance(box, (PyObject*) &BoxType)) {
+        PyErr_SetString(MapnikError, "set_maximum_extent requires a box object");
+        return NULL;
+    }
+
+    ExclusiveLock lock(self->state->lock);
+    self->state->writable().set_maximum_extent(*((MapnikBox2d*) box)->box);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_set_srs(MapnikMap *self, PyObject* args)
+{
+    char *c_srs;
+    if (!PyArg_ParseTuple(args, "s", &c_srs))
+        return NULL;
+
+    ExclusiveLock lock(self->state->lock);
+    self->state->writable().set_srs(std::string(c_srs));
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Map_zoom_to_box(MapnikMap *self, PyObject *box)
+{
+    if (!PyObject_IsInstance(box, (PyObject*) &BoxType)) {
+        PyErr_SetString(MapnikError, "zoom_to_box requires a box object");
+        return NULL;
+    }
+
+    MapnikBox2d* ourbox = (MapnikBox2d*) box;
+    MapState* state = self->state;
+    ExclusiveLock lock(state->lock);
+    state->extent = fit_aspect(*ourbox->box, state->width, state->height);
+    state->sync_view();
+    return Py_BuildValue("");
+}
+
+// The extent Map::zoom_all would zoom to: the extents of the active
+// layers, projected to the map's srs and clipped to the maximum extent, or
+// the maximum extent alone if no layer has one. The layer extents come from
+// layer_extent, so cached envelopes are used. Invalid if there's nothing to
+// zoom to.
+static mapnik::box2d<double>
+full_extent(mapnik::Map const& map, unsigned width, unsigned height)
+{
+    mapnik::projection map_proj(map.srs(), true);
+    mapnik::box2d<double> extent;
+    bool found = false;
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (!lyr.active() || !lyr.datasource())
+            continue;
+
+        mapnik::projection layer_proj(lyr.srs(), true);
+        mapnik::proj_transform transform(map_proj, layer_proj);
+        mapnik::box2d<double> box = layer_extent(lyr);
+        if (!transform.backward(box, 20))
+            continue;
+        if (found)
+            extent.expand_to_include(box);
+        else
+            extent = box;
+        found = true;
+    }
+
+    if (map.maximum_extent()) {
+        if (found)
+            extent.clip(*map.maximum_extent());
+        else
+            extent = *map.maximum_extent();
+    } else if (!found) {
+        return mapnik::box2d<double>();
+    }
+    return fit_aspect(extent, width, height);
+}
+
+// Zooms to the maximum extent, or if there is none to the extents of all
+// the layers
+static PyObject *
+Map_zoom_all(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+{
+    MapState* state = self->state;
+    mapnik::box2d<double> extent;
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        std::shared_lock<RWLock> lock(state->lock);
+        std::shared_lock<RWLock> dslock(datasource_lock);
+        extent = full_extent(*state->map, state->width, state->height);
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+
+    ExclusiveLock lock(state->lock);
+    if (extent.valid()) {
+        state->extent = extent;
+        state->sync_view();
+    }
+    return Py_BuildValue("");
+}
+
+static PyMethodDef Map_methods[] = {
+    {"add_layer", (PyCFunction) Map_add_layer, METH_VARARGS,
+     "Add a layer to the map. Later changes to the layer apply to the map"
+    },
+    {"add_style", (PyCFunction) Map_add_style, METH_VARARGS,
+     "Add a named style to the map. Later changes to the style apply to the map"
+    },
+    {"cache_layer_extents", (PyCFunction) Map_cache_layer_extents, METH_NOARGS,
+     "Remember the envelope of each layer's datasource for tile renders, until cleared"
+    },
+    {"clear_layer_extents", (PyCFunction) Map_clear_layer_extents, METH_NOARGS,
+     "Forget the envelopes stored by cache_layer_extents"
+    },
+    {"clone", (PyCFunction) Map_clone, METH_NOARGS,
+     "Return a map sharing this one's styles and layers, with its own size and extent"
+    },
+    {"get_srs", (PyCFunction) Map_get_srs, METH_NOARGS,
+     "Return the map's projection"
+    },
+    {"scale_denominator", (PyCFunction) Map_scale_denominator, METH_NOARGS,
+     "Return the scale denominator at the map's current extent"
+    },
+    {"set_background", (PyCFunction) Map_set_background, METH_O,
+     "Set background color for the map"
+    },
+    {"set_buffer_size", (PyCFunction) Map_set_buffer_size, METH_VARARGS,
+     "Set the buffer in pixels around the render extent to query"
+    },
+    {"set_maximum_extent", (PyCFunction) Map_set_maximum_extent, METH_O,
+     "Set the extent outside which nothing is queried"
+    },
+    {"set_srs", (PyCFunction) Map_set_srs, METH_VARARGS,
+     "Set map projection"
+    },
+    {"zoom_all", (PyCFunction) Map_zoom_all, METH_NOARGS,
+     "Zoom the map to show all layers"
+    },
+    {"zoom_to_box", (PyCFunction) Map_zoom_to_box, METH_O,
+     "Zoom the map to show the specified rectangle"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject MapType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.Map",
+    .tp_doc = PyDoc_STR("Map objects"),
+    .tp_basicsize = sizeof(MapnikMap),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Map_init,
+    .tp_dealloc = (destructor) Map_dealloc,
+    .tp_members = Map_members,
+    .tp_methods = Map_methods,
+};
+
+
+// ===========================================================================
+// PALETTE
+
+// rgba_palette caches the palette entry it chose for each colour, and the
+// cache isn't thread safe, so rather than sharing one rgba_palette every
+// thread that encodes with a palette builds its own from the palette data,
+// the first time it does. Every palette gets a serial number, never reused,
+// which identifies it to the threads and to caches of encoded images.
+
+static std::atomic<std::uint64_t> palette_serials(0);
+
+struct SharedPalette {
+    SharedPalette(std::string const& data, mapnik::rgba_palette::palette_type type)
+        : serial(++palette_serials), data(data), type(type) {}
+
+    const std::uint64_t serial;
+    const std::string data;
+    const mapnik::rgba_palette::palette_type type;
+};
+
+// A thread forgets the palettes it has built once it has this many, as
+// most of them will belong to Palette objects that are gone by then
+static const std::size_t MAX_THREAD_PALETTES = 16;
+
+static mapnik::rgba_palette const&
+thread_palette(SharedPalette const& shared)
+{
+    thread_local std::unordered_map<std::uint64_t, std::unique_ptr<mapnik::rgba_palette>> palettes;
+    auto found = palettes.find(shared.serial);
+    if (found != palettes.end())
+        return *found->second;
+
+    if (palettes.size() >= MAX_THREAD_PALETTES)
+        palettes.clear();
+    std::unique_ptr<mapnik::rgba_palette>& palette = palettes[shared.serial];
+    palette.reset(new mapnik::rgba_palette(shared.data, shared.type));
+    return *palette;
+}
+
+typedef struct {
+    PyObject_HEAD
+    std::shared_ptr<SharedPalette>* palette;
+} MapnikPalette;
+
+static void
+Palette_dealloc(MapnikPalette *self)
+{
+    delete self->palette;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Palette_init(MapnikPalette *self, PyObject *args)
+{
+    const char *data;
+    Py_ssize_t length;
+    const char *type = "rgba";
+    if (!PyArg_ParseTuple(args, "y#|s", &data, &length, &type))
+        return -1;
+
+    std::string name(type);
+    mapnik::rgba_palette::palette_type c_type;
+    if (name == "rgba")
+        c_type = mapnik::rgba_palette::PALETTE_RGBA;
+    else if (name == "rgb")
+        c_type = mapnik::rgba_palette::PALETTE_RGB;
+    else if (name == "act")
+        c_type = mapnik::rgba_palette::PALETTE_ACT;
+    else {
+        PyErr_SetString(MapnikError, "palette type must be 'rgba', 'rgb' or 'act'");
+        return -1;
+    }
+
+    std::string c_data(data, length);
+    if (!mapnik::rgba_palette(c_data, c_type).valid()) {
+        PyErr_SetString(MapnikError, "invalid palette data");
+        return -1;
+    }
+    self->palette = new std::shared_ptr<SharedPalette>(std::make_shared<SharedPalette>(c_data, c_type));
+
+    return 0;
+}
+
+static PyMemberDef Palette_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef Palette_methods[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject PaletteType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.Palette",
+    .tp_doc = PyDoc_STR("Palette objects"),
+    .tp_basicsize = sizeof(MapnikPalette),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Palette_init,
+    .tp_dealloc = (destructor) Palette_dealloc,
+    .tp_members = Palette_members,
+    .tp_methods = Palette_methods,
+};
+
+// ===========================================================================
+// ENCODER
+
+// What mapnik needs to encode an image: the format string, with the
+// encoder options, and optionally a fixed palette. Everywhere a format is
+// taken it can be given either as a format string or as an Encoder.
+
+struct ImageFormat {
+    ImageFormat() {}
+    ImageFormat(std::string const& format) : format(format) {}
+
+    std::string format;
+    std::shared_ptr<SharedPalette> palette;
+};
+
+template <typename T>
+static std::string
+encode_to_string(T const& image, ImageFormat const& format)
+{
+    if (!format.palette)
+        return mapnik::save_to_string(image, format.format);
+    return mapnik::save_to_string(image, format.format, thread_palette(*format.palette));
+}
+
+template <typename T>
+static void
+encode_to_stream(T const& image, std::ostream& stream, ImageFormat const& format)
+{
+    if (!format.palette) {
+        mapnik::save_to_stream(image, stream, format.format);
+        return;
+    }
+    mapnik::save_to_stream(image, stream, format.format, thread_palette(*format.palette));
+}
+
+template <typename T>
+static void
+encode_to_file(T const& image, std::string const& filename, ImageFormat const& format)
+{
+    if (!format.palette) {
+        mapnik::save_to_file(image, filename, format.format);
+        return;
+    }
+    mapnik::save_to_file(image, filename, format.format, thread_palette(*format.palette));
+}
+
+typedef struct {
+    PyObject_HEAD
+    ImageFormat* format;
+} MapnikEncoder;
+
+static void
+Encoder_dealloc(MapnikEncoder *self)
+{
+    delete self->format;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool
+is_png_format(std::string const& format)
+{
+    return format == "png" || format == "png8" || format == "png24" || format == "png32";
+}
+
+static int
+Encoder_init(MapnikEncoder *self, PyObject *args, PyObject *kwargs)
+{
+    const char *format = "png";
+    int colors = 0, zlib = -1, transparency = -1;
+    const char *strategy = NULL, *quantizer = NULL;
+    PyObject* palette = NULL;
+    int quality = -1, method = -1, lossless = 0;
+
+    static char *kwlist[] = {"format", "colors", "zlib", "strategy", "quantizer",
+                             "transparency", "palette", "quality", "method",
+                             "lossless", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|siizziOiip", kwlist,
+                                     &format, &colors, &zlib, &strategy,
+                                     &quantizer, &transparency, &palette,
+                                     &quality, &method, &lossless))
+        return -1;
+
+    std::string c_format(format);
+    bool png = is_png_format(c_format);
+    bool paletted = c_format == "png" || c_format == "png8";
+    if (palette == Py_None)
+        palette = NULL;
+
+    if (!png && c_format != "jpeg" && c_format != "webp") {
+        PyErr_SetString(MapnikError, "format must be png, png8, png24, png32, jpeg or webp");
+        return -1;
+    }
+    if (!png && (colors || zlib != -1 || strategy || quantizer || transparency != -1 || palette)) {
+        PyErr_SetString(MapnikError, "colors, zlib, strategy, quantizer, transparency and palette only apply to png");
+        return -1;
+    }
+    if (!paletted && (colors || quantizer || palette)) {
+        PyErr_SetString(MapnikError, "colors, quantizer and palette only apply to png8");
+        return -1;
+    }
+    if (png && quality != -1) {
+        PyErr_SetString(MapnikError, "quality only applies to jpeg and webp");
+        return -1;
+    }
+    if (c_format != "webp" && (method != -1 || lossless)) {
+        PyErr_SetString(MapnikError, "method and lossless only apply to webp");
+        return -1;
+    }
+    if (palette && !PyObject_IsInstance(palette, (PyObject*) &PaletteType)) {
+        PyErr_SetString(MapnikError, "palette must be a palette object");
+        return -1;
+    }
+
+    std::ostringstream spec;
+    spec << c_format;
+    if (colors) {
+        if (colors < 1 || colors > 256) {
+            PyErr_SetString(MapnikError, "colors must be between 1 and 256");
+            return -1;
+        }
+        spec << ":c=" << colors;
+    }
+    if (zlib != -1) {
+        if (zlib < 0 || zlib > 9) {
+            PyErr_SetString(MapnikError, "zlib must be between 0 and 9");
+            return -1;
+        }
+        spec << ":z=" << zlib;
+    }
+    if (strategy) {
+        std::string name(strategy);
+        if (name != "default" && name != "filtered" && name != "huffman" && name != "rle") {
+            PyErr_SetString(MapnikError, "strategy must be 'default', 'filtered', 'huffman' or 'rle'");
+            return -1;
+        }
+        // mapnik calls the huffman strategy "huff"
+        spec << ":s=" << (name == "huffman" ? "huff" : strategy);
+    }
+    if (quantizer) {
+        std::string name(quantizer);
+        if (name == "octree")
+            spec << ":m=o";
+        else if (name == "hextree")
+            spec << ":m=h";
+        else {
+            PyErr_SetString(MapnikError, "quantizer must be 'octree' or 'hextree'");
+            return -1;
+        }
+    }
+    if (transparency != -1) {
+        if (transparency < 0 || transparency > 2) {
+            PyErr_SetString(MapnikError, "transparency must be 0, 1 or 2");
+            return -1;
+        }
+        spec << ":t=" << transparency;
+    }
+    if (quality != -1) {
+        if (quality < 0 || quality > 100) {
+            PyErr_SetString(MapnikError, "quality must be between 0 and 100");
+            return -1;
+        }
+        spec << ":quality=" << quality;
+    }
+    if (method != -1) {
+        if (method < 0 || method > 6) {
+            PyErr_SetString(MapnikError, "method must be between 0 and 6");
+            return -1;
+        }
+        spec << ":method=" << method;
+    }
+    if (lossless)
+        spec << ":lossless=true";
+
+    self->format = new ImageFormat(spec.str());
+    if (palette)
+        self->format->palette = *((MapnikPalette*) palette)->palette;
+
+    return 0;
+}
+
+static PyMemberDef Encoder_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+Encoder_format(MapnikEncoder *self, PyObject *Py_UNUSED(ignored))
+{
+    return Py_BuildValue("s", self->format->format.c_str());
+}
+
+static PyMethodDef Encoder_methods[] = {
+    {"format", (PyCFunction) Encoder_format, METH_NOARGS,
+     "Return the format string passed to mapnik"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject EncoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.Encoder",
+    .tp_doc = PyDoc_STR("Encoder objects"),
+    .tp_basicsize = sizeof(MapnikEncoder),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Encoder_init,
+    .tp_dealloc = (destructor) Encoder_dealloc,
+    .tp_members = Encoder_members,
+    .tp_methods = Encoder_methods,
+};
+
+// Converter for PyArg_ParseTuple ("O&") that takes a format string or an
+// Encoder
+static int
+image_format_converter(PyObject* obj, void* result)
+{
+    ImageFormat* format = (ImageFormat*) result;
+    if (PyUnicode_Check(obj)) {
+        const char* str = PyUnicode_AsUTF8(obj);
+        if (str == NULL)
+            return 0;
+        *format = ImageFormat(str);
+        return 1;
+    }
+    if (PyObject_IsInstance(obj, (PyObject*) &EncoderType)) {
+        *format = *((MapnikEncoder*) obj)->format;
+        return 1;
+    }
+    PyErr_SetString(MapnikError, "format must be a string or an encoder object");
+    return 0;
+}
+
+// ===========================================================================
+// IMAGE
+
+// The pixels are premultiplied RGBA, as agg renders them, and are exposed
+// through the buffer protocol as a (height, width, 4) array of bytes, so
+// they can be read and modified without copying.
+
+typedef struct {
+    PyObject_HEAD
+    mapnik::image_rgba8* image;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+} MapnikImage;
+
+static void
+Image_dealloc(MapnikImage *self)
+{
+    delete self->image;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Image_init(MapnikImage *self, PyObject *args)
+{
+    int width, height;
+    if (!PyArg_ParseTuple(args, "ii", &width, &height))
+        return -1;
+
+    if (width <= 0 || height <= 0) {
+        PyErr_SetString(MapnikError, "image width and height must be positive");
+        return -1;
+    }
+
+    self->image = new mapnik::image_rgba8(width, height);
+    self->shape[0] = height;
+    self->shape[1] = width;
+    self->shape[2] = 4;
+    self->strides[0] = width * 4;
+    self->strides[1] = 4;
+    self->strides[2] = 1;
+    return 0;
+}
+
+static int
+Image_getbuffer(MapnikImage *self, Py_buffer *view, int flags)
+{
+    mapnik::image_rgba8& image = *self->image;
+    if (!(flags & PyBUF_ND))
+        return PyBuffer_FillInfo(view, (PyObject*) self, image.bytes(), image.size(), 0, flags);
+
+    view->obj = (PyObject*) self;
+    Py_INCREF(self);
+    view->buf = image.bytes();
+    view->len = image.size();
+    view->readonly = 0;
+    view->itemsize = 1;
+    view->format = (flags & PyBUF_FORMAT) ? (char*) "B" : NULL;
+    view->ndim = 3;
+    view->shape = self->shape;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyBufferProcs Image_as_buffer = {
+    .bf_getbuffer = (getbufferproc) Image_getbuffer,
+    .bf_releasebuffer = NULL,
+};
+
+static PyMemberDef Image_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+Image_width(MapnikImage *self, PyObject *Py_UNUSED(ignored))
+{
+    return Py_BuildValue("n", (Py_ssize_t) self->image->width());
+}
+
+static PyObject *
+Image_height(MapnikImage *self, PyObject *Py_UNUSED(ignored))
+{
+    return Py_BuildValue("n", (Py_ssize_t) self->image->height());
+}
+
+static PyObject *
+Image_is_solid(MapnikImage *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyBool_FromLong(mapnik::is_solid(*self->image));
+}
+
+static PyObject *
+Image_clear(MapnikImage *self, PyObject *Py_UNUSED(ignored))
+{
+    self->image->set(0);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Image_demultiply(MapnikImage *self, PyObject *Py_UNUSED(ignored))
+{
+    mapnik::demultiply_alpha(*self->image);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Image_save(MapnikImage *self, PyObject *args)
+{
+    const char *filename;
+    ImageFormat format;
+    if (!PyArg_ParseTuple(args, "sO&", &filename, image_format_converter, &format))
+        return NULL;
+
+    std::string c_filename(filename);
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        encode_to_file(*self->image, c_filename, format);
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+    return Py_BuildValue("");
+}
+
+static PyObject *
+Image_tostring(MapnikImage *self, PyObject *args)
+{
+    ImageFormat format;
+    if (!PyArg_ParseTuple(args, "O&", image_format_converter, &format))
+        return NULL;
+
+    std::string data;
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        data = encode_to_string(*self->image, format);
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(data.data(), data.size());
+}
+
+static PyMethodDef Image_methods[] = {
+    {"clear", (PyCFunction) Image_clear, METH_NOARGS,
+     "Set all pixels to transparent"
+    },
+    {"demultiply", (PyCFunction) Image_demultiply, METH_NOARGS,
+     "Convert the pixels from premultiplied to straight alpha"
+    },
+    {"height", (PyCFunction) Image_height, METH_NOARGS,
+     "Return height in pixels"
+    },
+    {"is_solid", (PyCFunction) Image_is_solid, METH_NOARGS,
+     "Return True if all pixels have the same colour"
+    },
+    {"save", (PyCFunction) Image_save, METH_VARARGS,
+     "Encode the image and write it to file"
+    },
+    {"tostring", (PyCFunction) Image_tostring, METH_VARARGS,
+     "Encode the image and return it as bytes"
+    },
+    {"width", (PyCFunction) Image_width, METH_NOARGS,
+     "Return width in pixels"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject ImageType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.Image",
+    .tp_doc = PyDoc_STR("Image objects"),
+    .tp_basicsize = sizeof(MapnikImage),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Image_init,
+    .tp_dealloc = (destructor) Image_dealloc,
+    .tp_as_buffer = &Image_as_buffer,
+    .tp_members = Image_members,
+    .tp_methods = Image_methods,
+};
+
+
+// ===========================================================================
+// LABEL COLLISION DETECTOR
+
+// Keeps the boxes of placed labels between renders, so that labels on
+// adjacent tiles don't collide across the seams. The boxes are stored in
+// map coordinates, because the renderer's detector works in pixels of the
+// current render, which differ from one tile to the next.
+
+struct LabelBoxes {
+    RWLock lock;
+    std::vector<mapnik::box2d<double>> boxes;
+};
+
+typedef struct {
+    PyObject_HEAD
+    LabelBoxes* labels;
+} MapnikLabelCollisionDetector;
+
+static void
+LabelCollisionDetector_dealloc(MapnikLabelCollisionDetector *self)
+{
+    delete self->labels;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+LabelCollisionDetector_init(MapnikLabelCollisionDetector *self, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, ""))
+        return -1;
+
+    self->labels = new LabelBoxes();
+
+    return 0;
+}
+
+static PyMemberDef LabelCollisionDetector_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+LabelCollisionDetector_add_box(MapnikLabelCollisionDetector *self, PyObject *args)
+{
+    double minx, miny, maxx, maxy;
+    if (!PyArg_ParseTuple(args, "dddd", &minx, &miny, &maxx, &maxy))
+        return NULL;
+
+    ExclusiveLock lock(self->labels->lock);
+    self->labels->boxes.push_back(mapnik::box2d<double>(minx, miny, maxx, maxy));
+    return Py_BuildValue("");
+}
+
+static PyObject *
+LabelCollisionDetector_clear(MapnikLabelCollisionDetector *self, PyObject *Py_UNUSED(ignored))
+{
+    ExclusiveLock lock(self->labels->lock);
+    self->labels->boxes.clear();
+    return Py_BuildValue("");
+}
+
+static PyObject *
+LabelCollisionDetector_count(MapnikLabelCollisionDetector *self, PyObject *Py_UNUSED(ignored))
+{
+    ExclusiveLock lock(self->labels->lock);
+    return Py_BuildValue("n", (Py_ssize_t) self->labels->boxes.size());
+}
+
+static PyObject *
+LabelCollisionDetector_get_boxes(MapnikLabelCollisionDetector *self, PyObject *Py_UNUSED(ignored))
+{
+    ExclusiveLock lock(self->labels->lock);
+    PyObject* result = PyList_New(self->labels->boxes.size());
+    for (std::size_t ix = 0; ix < self->labels->boxes.size(); ix++) {
+        mapnik::box2d<double> const& box = self->labels->boxes[ix];
+        PyList_SET_ITEM(result, ix, Py_BuildValue("(dddd)", box.minx(), box.miny(),
+                                                  box.maxx(), box.maxy()));
+    }
+    return result;
+}
+
+static PyMethodDef LabelCollisionDetector_methods[] = {
+    {"add_box", (PyCFunction) LabelCollisionDetector_add_box, METH_VARARGS,
+     "Add the box of a label, in map coordinates"
+    },
+    {"clear", (PyCFunction) LabelCollisionDetector_clear, METH_NOARGS,
+     "Forget all label boxes"
+    },
+    {"count", (PyCFunction) LabelCollisionDetector_count, METH_NOARGS,
+     "Return the number of label boxes"
+    },
+    {"get_boxes", (PyCFunction) LabelCollisionDetector_get_boxes, METH_NOARGS,
+     "Return the label boxes as (minx, miny, maxx, maxy) tuples in map coordinates"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject LabelCollisionDetectorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.LabelCollisionDetector",
+    .tp_doc = PyDoc_STR("Label collision detector objects"),
+    .tp_basicsize = sizeof(MapnikLabelCollisionDetector),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) LabelCollisionDetector_init,
+    .tp_dealloc = (destructor) LabelCollisionDetector_dealloc,
+    .tp_members = LabelCollisionDetector_members,
+    .tp_methods = LabelCollisionDetector_methods,
+};
+
+// ===========================================================================
+// RENDERING
+
+// Runs func(map, view) holding the map and datasource locks for reading,
+// with view a request for the Map object's own size, extent and buffer
+// size. Must be called without the GIL.
+template <typename Func>
+static void
+with_map_read_locked(const MapnikMap* themap, Func func)
+{
+    std::shared_lock<RWLock> maplock(themap->state->lock);
+    std::shared_lock<RWLock> dslock(datasource_lock);
+    func(*themap->state->map, themap->state->view());
+}
+
+// Runs func(map, view) with the GIL released, holding the map and datasource
+// locks for reading. Any exception from mapnik is turned into a Python
+// error, in which case false is returned.
+template <typename Func>
+static bool
+render_without_gil(const MapnikMap* themap, Func func)
+{
+    bool ok = true;
+    std::string error;
+
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        with_map_read_locked(themap, func);
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok)
+        PyErr_SetString(MapnikError, error.c_str());
+    return ok;
+}
+
+// A streambuf that writes into a fixed block of memory, so that images can
+// be encoded straight into a buffer supplied by the caller. Writing past
+// the end puts the stream into a failed state.
+class MemoryStreambuf : public std::streambuf {
+public:
+    MemoryStreambuf(char* data, std::size_t size)
+    {
+        setp(data, data + size);
+    }
+
+    std::size_t written() const
+    {
+        return pptr() - pbase();
+    }
+};
+
+static const std::size_t WRITE_CHUNK_SIZE = 64 * 1024;
+
+// Passes the data to the write method of a Python file-like object, a
+// chunk at a time, so that no one call has to copy all of it. Must be
+// called with the GIL, and without any map lock held, since write may
+// well touch the map.
+static bool
+write_in_chunks(PyObject* file, std::string const& data)
+{
+    for (std::size_t offset = 0; offset < data.size(); offset += WRITE_CHUNK_SIZE) {
+        std::size_t size = std::min(WRITE_CHUNK_SIZE, data.size() - offset);
+        PyObject* result = PyObject_CallMethod(file, "write", "y#",
+                                               data.data() + offset, (Py_ssize_t) size);
+        if (result == NULL)
+            return false;
+        Py_DECREF(result);
+    }
+    return true;
+}
+
+// True if the layer's extent is known without asking its datasource, and
+// misses the box, which is in the map's coordinates. Mapnik would still
+// ask the datasource for its envelope before finding that out.
+static bool
+layer_misses(mapnik::layer const& lyr, mapnik::projection const& map_proj,
+             mapnik::box2d<double> const& box)
+{
+    mapnik::box2d<double> extent;
+    if (!lyr.datasource() || !known_layer_extent(lyr, extent))
+        return false;
+
+    mapnik::projection layer_proj(lyr.srs(), true);
+    mapnik::proj_transform transform(map_proj, layer_proj);
+    if (!transform.backward(extent, 20))
+        return false;
+    return !extent.intersects(box);
+}
+
+// Renders the map at the extent and size given by the request, instead of
+// the map's own. This is what feature_style_processor::apply() does, except
+// that apply() reads the extent from the map, so the map would have to be
+// zoomed first, and could then only be used for one render at a time.
+// Layers whose extent is known to miss the buffered extent are skipped.
+template <typename Renderer>
+static void
+apply_request(Renderer& ren, mapnik::Map const& map, mapnik::request const& req)
+{
+    mapnik::projection proj(map.srs(), true);
+    double scale = req.extent().width() / req.width();
+    double scale_denom = mapnik::scale_denominator(scale, proj.is_geographic()) * ren.scale_factor();
+
+    mapnik::box2d<double> buffered = req.get_buffered_extent();
+
+    ren.start_map_processing(map);
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (lyr.visible(scale_denom) && !layer_misses(lyr, proj, buffered)) {
+            std::set<std::string> names;
+            ren.apply_to_layer(lyr, ren, proj, scale, scale_denom,
+                               req.width(), req.height(), req.extent(),
+                               req.buffer_size(), names);
+        }
+    }
+    ren.end_map_processing(map);
+}
+
+// ---------------------------------------------------------------------------
+// Web mercator tiles
+
+static const double MERCATOR_MAX = 20037508.342789244;
+
+// A block of columns x rows tiles with (x, y) as the upper left tile
+struct Metatile {
+    int z, x, y;
+    int columns, rows;
+
+    mapnik::box2d<double> extent() const
+    {
+        double span = 2 * MERCATOR_MAX / std::ldexp(1.0, z);
+        return mapnik::box2d<double>(-MERCATOR_MAX + x * span,
+                                     MERCATOR_MAX - (y + rows) * span,
+                                     -MERCATOR_MAX + (x + columns) * span,
+                                     MERCATOR_MAX - y * span);
+    }
+};
+
+// The scale denominator of web mercator tiles at zoom level z
+static double
+zoom_scale_denominator(int z, int tile_size)
+{
+    return mapnik::scale_denominator(2 * MERCATOR_MAX / (tile_size * std::ldexp(1.0, z)), false);
+}
+
+// Mapnik skips layers that aren't visible at the scale before querying
+// them, and evaluates only the rules that are active at the scale. A
+// visible layer whose styles have no active rules isn't queried at all.
+// This works out which layers and styles that leaves at a scale, so
+// stylesheets can be checked without rendering.
+static std::vector<std::pair<std::string, std::vector<std::string>>>
+active_styles(mapnik::Map const& map, double scale_denom)
+{
+    std::vector<std::pair<std::string, std::vector<std::string>>> plan;
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (!lyr.visible(scale_denom))
+            continue;
+
+        std::vector<std::string> names;
+        for (std::string const& name : lyr.styles()) {
+            auto found = map.styles().find(name);
+            if (found == map.styles().end())
+                continue;
+            for (mapnik::rule const& rule : found->second.get_rules()) {
+                if (rule.active(scale_denom)) {
+                    names.push_back(name);
+                    break;
+                }
+            }
+        }
+        if (!names.empty())
+            plan.push_back(std::make_pair(lyr.name(), names));
+    }
+    return plan;
+}
+
+// Returns the metatile of size x size tiles that contains tile (x, y),
+// cut off at the edges of the world
+static Metatile
+metatile_for(int z, int x, int y, int size)
+{
+    int tiles = 1 << z;
+    Metatile meta;
+    meta.z = z;
+    meta.x = x - x % size;
+    meta.y = y - y % size;
+    meta.columns = std::min(size, tiles - meta.x);
+    meta.rows = std::min(size, tiles - meta.y);
+    return meta;
+}
+
+static const int MAX_METATILE_PIXELS = 16384;
+
+// Checks tile coordinates and metatile arguments from Python. The metatile
+// with its buffer is rendered as one image, so its size is capped.
+static bool
+check_tile(int z, int x, int y)
+{
+    if (z < 0 || z > 30 || x < 0 || y < 0 || x >= (1 << z) || y >= (1 << z)) {
+        PyErr_SetString(MapnikError, "tile coordinates out of range");
+        return false;
+    }
+    return true;
+}
+
+static bool
+check_metatile(int metatile, int size, int buffer)
+{
+    if (metatile < 1 || size < 1 || buffer < 0) {
+        PyErr_SetString(MapnikError, "metatile and size must be positive, buffer non-negative");
+        return false;
+    }
+    if (size > MAX_METATILE_PIXELS / metatile ||
+        buffer > (MAX_METATILE_PIXELS - metatile * size) / 2) {
+        PyErr_Format(MapnikError, "metatile images can be at most %d pixels wide",
+                     MAX_METATILE_PIXELS);
+        return false;
+    }
+    return true;
+}
+
+// Tile coordinates only make sense for a map in web mercator. This is
+// checked while the map is locked, so it throws.
+static void
+check_mercator(mapnik::Map const& map)
+{
+    std::string const& srs = map.srs();
+    boost::optional<mapnik::well_known_srs_e> known = mapnik::is_well_known_srs(srs);
+    if ((known && *known == mapnik::G_MERC) ||
+        srs == "epsg:3857" || srs == "+init=epsg:3857" ||
+        srs == "epsg:900913" || srs == "+init=epsg:900913")
+        return;
+    throw std::runtime_error("tiles require a map in web mercator (EPSG:3857), not " + srs);
+}
+
+// Makes the image blank and of the given size, keeping its memory if it
+// already has the right size
+static void
+reset_image(mapnik::image_rgba8& image, unsigned width, unsigned height)
+{
+    if (image.width() == width && image.height() == height)
+        image.set(0);
+    else
+        image = mapnik::image_rgba8(width, height);
+}
+
+// ---------------------------------------------------------------------------
+// Image pool
+
+// Allocating and clearing a new image for every render is expensive for
+// large images. When the pool is turned on, each thread instead keeps the
+// image it last rendered into and reuses it for the next render of the
+// same size.
+
+static std::atomic<bool> image_pool_enabled(false);
+
+static mapnik::image_rgba8&
+thread_image()
+{
+    thread_local mapnik::image_rgba8 image;
+    return image;
+}
+
+// Returns the image to render into: the thread's own image if the pool is
+// on, otherwise the one passed in
+static mapnik::image_rgba8&
+scratch_image(mapnik::image_rgba8& local)
+{
+    return image_pool_enabled ? thread_image() : local;
+}
+
+static void
+render_request(mapnik::Map const& map, mapnik::request const& req,
+               mapnik::image_rgba8& image)
+{
+    reset_image(image, req.width(), req.height());
+    mapnik::attributes vars;
+    mapnik::agg_renderer<mapnik::image_rgba8> ren(map, req, vars, image);
+    apply_request(ren, map, req);
+}
+
+static mapnik::request
+metatile_request(mapnik::Map const& map, Metatile const& meta, int tile_size,
+                 int buffer_size)
+{
+    check_mercator(map);
+    mapnik::request req(meta.columns * tile_size, meta.rows * tile_size, meta.extent());
+    req.set_buffer_size(buffer_size);
+    return req;
+}
+
+// ---------------------------------------------------------------------------
+// Empty and solid tiles
+
+// Tiles with nothing on them render as the bare background, so whether a
+// tile is empty can be found by asking the datasources whether anything
+// falls inside its buffered extent, which is much cheaper than rendering.
+// The bare background is then rendered and encoded once, and shared by all
+// empty tiles. Tiles that turn out to be a single colour after rendering
+// are likewise encoded once per colour.
+
+static std::mutex tile_cache_lock;
+static std::map<std::string, std::string> blank_tiles;
+static std::map<std::string, std::string> solid_tiles;
+
+// blank_tiles has one entry per background and format seen, and
+// solid_tiles one per colour, so both are capped
+static const std::size_t MAX_BLANK_TILES = 256;
+static const std::size_t MAX_SOLID_TILES = 256;
+
+// Returns true if any layer visible at the scale has something inside the
+// box, which is in the map's coordinates. Raster layers count as soon as
+// their extent overlaps the box.
+static bool
+has_features(mapnik::Map const& map, mapnik::box2d<double> const& box,
+             double resolution, double scale_denom)
+{
+    mapnik::projection map_proj(map.srs(), true);
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (!lyr.visible(scale_denom) || !lyr.datasource())
+            continue;
+
+        mapnik::projection layer_proj(lyr.srs(), true);
+        mapnik::proj_transform transform(map_proj, layer_proj);
+        mapnik::box2d<double> query_box(box);
+        if (!transform.forward(query_box, 20))
+            return true; // can't tell, so assume there is
+
+        if (!query_box.intersects(layer_extent(lyr)))
+            continue;
+        mapnik::datasource_ptr ds = lyr.datasource();
+        if (ds->type() == mapnik::datasource::Raster)
+            return true;
+
+        mapnik::query q(query_box, mapnik::query::resolution_type(resolution, resolution), scale_denom);
+        mapnik::featureset_ptr features = ds->features(q);
+        if (features && mapnik::is_valid(features) && features->next())
+            return true;
+    }
+    return false;
+}
+
+// True if no layer has anything inside the metatile's buffered extent
+static bool
+metatile_is_empty(mapnik::Map const& map, Metatile const& meta, int tile_size,
+                  int buffer_size)
+{
+    mapnik::request req = metatile_request(map, meta, tile_size, buffer_size);
+    mapnik::projection proj(map.srs(), true);
+    double scale = req.extent().width() / req.width();
+    double scale_denom = mapnik::scale_denominator(scale, proj.is_geographic());
+    return !has_features(map, req.get_buffered_extent(), 1 / scale, scale_denom);
+}
+
+static std::string
+format_key(ImageFormat const& format)
+{
+    std::ostringstream key;
+    key << format.format << '|' << (format.palette ? format.palette->serial : 0);
+    return key.str();
+}
+
+// Returns the encoded tile for a tile with nothing but the map's
+// background on it
+static std::string
+blank_tile(mapnik::Map const& map, int tile_size, ImageFormat const& format)
+{
+    std::ostringstream keystream;
+    keystream << tile_size << '|' << format_key(format) << '|'
+              << (map.background() ? map.background()->to_string() : "") << '|'
+              << (map.background_image() ? *map.background_image() : "") << '|'
+              << map.background_image_comp_op() << '|'
+              << map.background_image_opacity();
+    std::string key = keystream.str();
+    {
+        std::lock_guard<std::mutex> guard(tile_cache_lock);
+        auto found = blank_tiles.find(key);
+        if (found != blank_tiles.end())
+            return found->second;
+    }
+
+    mapnik::Map bare(tile_size, tile_size, map.srs());
+    if (map.background())
+        bare.set_background(*map.background());
+    if (map.background_image()) {
+        bare.set_background_image(*map.background_image());
+        bare.set_background_image_comp_op(map.background_image_comp_op());
+        bare.set_background_image_opacity(map.background_image_opacity());
+    }
+    bare.set_base_path(map.base_path());
+    bare.zoom_to_box(mapnik::box2d<double>(0, 0, 1, 1));
+
+    mapnik::image_rgba8 image(tile_size, tile_size);
+    mapnik::agg_renderer<mapnik::image_rgba8> ren(bare, image);
+    ren.apply();
+    std::string data = encode_to_string(image, format);
+
+    std::lock_guard<std::mutex> guard(tile_cache_lock);
+    if (blank_tiles.size() < MAX_BLANK_TILES)
+        blank_tiles[key] = data;
+    return data;
+}
+
+// Returns true, and the pixel value, if every pixel of the view is the same
+static bool
+is_solid_view(mapnik::image_view_rgba8 const& view, std::uint32_t& pixel)
+{
+    pixel = view.get_row(0)[0];
+    for (std::size_t y = 0; y < view.height(); y++) {
+        mapnik::image_view_rgba8::pixel_type const* row = view.get_row(y);
+        for (std::size_t x = 0; x < view.width(); x++)
+            if (row[x] != pixel)
+                return false;
+    }
+    return true;
+}
+
+// Encodes a view that is all one colour, via the cache
+static std::string
+solid_tile(mapnik::image_view_rgba8 const& view, std::uint32_t pixel,
+           ImageFormat const& format)
+{
+    std::ostringstream keystream;
+    keystream << pixel << '|' << view.width() << 'x' << view.height() << '|' << format_key(format);
+    std::string key = keystream.str();
+    {
+        std::lock_guard<std::mutex> guard(tile_cache_lock);
+        auto found = solid_tiles.find(key);
+        if (found != solid_tiles.end())
+            return found->second;
+    }
+
+    std::string data = encode_to_string(view, format);
+
+    std::lock_guard<std::mutex> guard(tile_cache_lock);
+    if (solid_tiles.size() < MAX_SOLID_TILES)
+        solid_tiles[key] = data;
+    return data;
+}
+
+// Encodes one tile of a rendered metatile
+static std::string
+encode_tile(mapnik::image_rgba8 const& image, int col, int row,
+            int tile_size, ImageFormat const& format)
+{
+    mapnik::image_view_rgba8 view(col * tile_size, row * tile_size,
+                                  tile_size, tile_size, image);
+    std::uint32_t pixel;
+    if (is_solid_view(view, pixel))
+        return solid_tile(view, pixel, format);
+    return encode_to_string(view, format);
+}
+
+// Cuts up the rendered metatile and encodes each tile separately. Tiles
+// are returned row by row.
+static std::vector<std::string>
+encode_metatile(mapnik::image_rgba8 const& image, Metatile const& meta,
+                int tile_size, ImageFormat const& format)
+{
+    std::vector<std::string> tiles;
+    for (int row = 0; row < meta.rows; row++)
+        for (int col = 0; col < meta.columns; col++)
+            tiles.push_back(encode_tile(image, col, row, tile_size, format));
+    return tiles;
+}
+
+// Renders the whole metatile as one image, then encodes the tiles
+static std::vector<std::string>
+render_metatile(mapnik::Map const& map, Metatile const& meta, int tile_size,
+                int buffer_size, ImageFormat const& format)
+{
+    mapnik::image_rgba8 local;
+    mapnik::image_rgba8& image = scratch_image(local);
+    render_request(map, metatile_request(map, meta, tile_size, buffer_size), image);
+    return encode_metatile(image, meta, tile_size, format);
+}
+
+#ifdef HAVE_CAIRO
+static bool
+is_cairo_format(std::string const& format)
+{
+    return format == "svg" || format == "pdf";
+}
+
+static cairo_status_t
+write_to_stream(void *closure, const unsigned char *data, unsigned int length)
+{
+    std::ostream* stream = static_cast<std::ostream*>(closure);
+    stream->write((const char*) data, length);
+    return stream->good() ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+// Does the same as save_to_cairo_file at the requested extent and size,
+// except the output goes to a stream
+static void
+render_cairo_to_stream(mapnik::Map const& map, mapnik::request const& req,
+                       std::string const& format, std::ostream& stream)
+{
+    mapnik::cairo_surface_ptr surface;
+    if (format == "svg")
+        surface = mapnik::cairo_surface_ptr(cairo_svg_surface_create_for_stream(write_to_stream, &stream, req.width(), req.height()), mapnik::cairo_surface_closer());
+    else
+        surface = mapnik::cairo_surface_ptr(cairo_pdf_surface_create_for_stream(write_to_stream, &stream, req.width(), req.height()), mapnik::cairo_surface_closer());
+
+    mapnik::attributes vars;
+    mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, req, vars, mapnik::create_context(surface), 1.0);
+    apply_request(ren, map, req);
+    cairo_surface_finish(&*surface);
+}
+#endif
+
+// Renders the map at the requested extent and size and writes the encoded
+// image to the stream, without going via the file system
+static void
+render_to_stream(mapnik::Map const& map, mapnik::request const& req,
+                 ImageFormat const& format, std::ostream& stream)
+{
+#ifdef HAVE_CAIRO
+    if (is_cairo_format(format.format)) {
+        render_cairo_to_stream(map, req, format.format, stream);
+        return;
+    }
+#endif
+
+    mapnik::image_rgba8 local;
+    mapnik::image_rgba8& image = scratch_image(local);
+    render_request(map, req, image);
+    encode_to_stream(image, stream, format);
+}
+
+// Renders the map at the requested extent and size and returns the
+// encoded image. Agg renders into the scratch image, whose memory is
+// reused if it's the right size already.
+static std::string
+render_to_string(mapnik::Map const& map, mapnik::request const& req,
+                 ImageFormat const& format, mapnik::image_rgba8& image)
+{
+#ifdef HAVE_CAIRO
+    if (is_cairo_format(format.format)) {
+        std::ostringstream stream;
+        render_cairo_to_stream(map, req, format.format, stream);
+        return stream.str();
+    }
+#endif
+
+    render_request(map, req, image);
+    return encode_to_string(image, format);
+}
+
+
+// ---------------------------------------------------------------------------
+// Shared labels
+
+// Renders the map at its own extent, with the renderer's label collision
+// detector seeded with the stored boxes that fall inside the buffered
+// extent. Afterwards those boxes are replaced by everything in the
+// detector, which is the seeded boxes plus the labels placed by this
+// render. The boxes stay locked for the whole render, so that renders
+// sharing them see each other's labels.
+static void
+render_with_labels(mapnik::Map const& map, mapnik::image_rgba8& image,
+                   LabelBoxes& labels)
+{
+    std::unique_lock<RWLock> lock(labels.lock);
+
+    int buffer = map.buffer_size();
+    mapnik::box2d<double> pixels(-buffer, -buffer, map.width() + buffer, map.height() + buffer);
+    mapnik::view_transform transform(map.width(), map.height(), map.get_current_extent());
+    mapnik::box2d<double> extent = transform.backward(pixels);
+
+    auto detector = std::make_shared<mapnik::label_collision_detector4>(pixels);
+    std::vector<mapnik::box2d<double>> boxes;
+    for (mapnik::box2d<double> const& box : labels.boxes) {
+        if (box.intersects(extent))
+            detector->insert(transform.forward(box));
+        else
+            boxes.push_back(box);
+    }
+
+    mapnik::request req(map.width(), map.height(), map.get_current_extent());
+    req.set_buffer_size(buffer);
+    reset_image(image, map.width(), map.height());
+    mapnik::agg_renderer<mapnik::image_rgba8> ren(map, image, detector);
+    apply_request(ren, map, req);
+
+    for (auto const& label : *detector)
+        boxes.push_back(transform.backward(label.box));
+    labels.boxes.swap(boxes);
+}
+
+// Does what render_metatile does, with shared labels. The renderer only
+// takes a detector together with the map's own extent, so the render
+// goes through a copy of the map zoomed to the metatile.
+static std::vector<std::string>
+render_metatile_with_labels(mapnik::Map const& map, Metatile const& meta,
+                            int tile_size, int buffer_size,
+                            ImageFormat const& format, LabelBoxes& labels)
+{
+    check_mercator(map);
+    mapnik::Map copy(map);
+    copy.resize(meta.columns * tile_size, meta.rows * tile_size);
+    copy.set_buffer_size(buffer_size);
+    copy.zoom_to_box(meta.extent());
+
+    mapnik::image_rgba8 local;
+    mapnik::image_rgba8& image = scratch_image(local);
+    render_with_labels(copy, image, labels);
+    return encode_metatile(image, meta, tile_size, format);
+}
+
+// ---------------------------------------------------------------------------
+// Dirty rectangles
+
+// A rectangle of pixels, from (x0, y0) up to but not including (x1, y1)
+struct PixelRect {
+    int x0, y0, x1, y1;
+
+    int area() const
+    {
+        return (x1 - x0) * (y1 - y0);
+    }
+
+    bool overlaps(PixelRect const& other) const
+    {
+        return x0 <= other.x1 && other.x0 <= x1 && y0 <= other.y1 && other.y0 <= y1;
+    }
+};
+
+// Cuts a pixel coordinate off at the edges of the image. This is done
+// before converting to int, as boxes far outside the map give coordinates
+// that don't fit in one.
+static int
+clamp_pixel(double value, int limit)
+{
+    return int(std::max(0.0, std::min(double(limit), value)));
+}
+
+// Turns the dirty boxes, in map coordinates, into pixel rectangles grown
+// by buffer pixels on every side and cut off at the edges of the image.
+// Rectangles that overlap or touch are merged.
+static std::vector<PixelRect>
+dirty_rects(mapnik::request const& view, std::vector<mapnik::box2d<double>> const& boxes,
+            int buffer)
+{
+    mapnik::view_transform transform(view.width(), view.height(), view.extent());
+    int width = view.width(), height = view.height();
+
+    std::vector<PixelRect> rects;
+    for (mapnik::box2d<double> const& box : boxes) {
+        mapnik::box2d<double> pixels = transform.forward(box);
+        PixelRect rect;
+        rect.x0 = clamp_pixel(std::floor(pixels.minx()) - buffer, width);
+        rect.y0 = clamp_pixel(std::floor(pixels.miny()) - buffer, height);
+        rect.x1 = clamp_pixel(std::ceil(pixels.maxx()) + buffer, width);
+        rect.y1 = clamp_pixel(std::ceil(pixels.maxy()) + buffer, height);
+        if (rect.x0 < rect.x1 && rect.y0 < rect.y1)
+            rects.push_back(rect);
+    }
+
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (std::size_t ix = 0; ix < rects.size() && !merged; ix++) {
+            for (std::size_t jx = ix + 1; jx < rects.size() && !merged; jx++) {
+                if (!rects[ix].overlaps(rects[jx]))
+                    continue;
+                rects[ix].x0 = std::min(rects[ix].x0, rects[jx].x0);
+                rects[ix].y0 = std::min(rects[ix].y0, rects[jx].y0);
+                rects[ix].x1 = std::max(rects[ix].x1, rects[jx].x1);
+                rects[ix].y1 = std::max(rects[ix].y1, rects[jx].y1);
+                rects.erase(rects.begin() + jx);
+                merged = true;
+            }
+        }
+    }
+    return rects;
+}
+
+// Re-renders the parts of the image covered by the dirty boxes, leaving
+// the rest as it was. Each rectangle is rendered on its own, at exactly
+// the extent its pixels cover, with the map's buffer so that symbols from
+// features outside it still reach into it. Labels are placed per
+// rectangle, so they can differ from a full render. If the rectangles
+// cover more than half the image the whole map is rendered instead.
+// Returns the number of pixels rendered.
+static std::size_t
+render_dirty(mapnik::Map const& map, mapnik::request const& view,
+             mapnik::image_rgba8& image,
+             std::vector<mapnik::box2d<double>> const& boxes, int buffer)
+{
+    std::vector<PixelRect> rects = dirty_rects(view, boxes, buffer);
+    std::size_t total = 0;
+    for (PixelRect const& rect : rects)
+        total += rect.area();
+
+    if (total * 2 > image.width() * image.height()) {
+        render_request(map, view, image);
+        return image.width() * image.height();
+    }
+
+    mapnik::view_transform transform(view.width(), view.height(), view.extent());
+    mapnik::image_rgba8 part;
+    for (PixelRect const& rect : rects) {
+        mapnik::box2d<double> extent = transform.backward(
+            mapnik::box2d<double>(rect.x0, rect.y0, rect.x1, rect.y1));
+        mapnik::request req(rect.x1 - rect.x0, rect.y1 - rect.y0, extent);
+        req.set_buffer_size(view.buffer_size());
+        render_request(map, req, part);
+
+        for (int row = 0; row < rect.y1 - rect.y0; row++)
+            std::memcpy(image.get_row(rect.y0 + row) + rect.x0, part.get_row(row),
+                        (rect.x1 - rect.x0) * sizeof(mapnik::image_rgba8::pixel_type));
+    }
+    return total;
+}
+
+// ---------------------------------------------------------------------------
+// Render statistics
+
+// Mapnik has no hooks for watching a render, so to measure each layer and
+// style separately the map is rendered in one pass per style of each
+// layer, into the same image and with the same label collision detector.
+// Mapnik renders the styles of a layer one after the other anyway, so the
+// result is the same as a normal render. The one difference is that layer
+// opacity and comp-op are applied per style rather than to the whole
+// layer. Every pass gets a datasource wrapper that counts the features
+// read and keeps them. Which rules apply to each is worked out after the
+// pass has been timed, so that evaluating the filters a second time isn't
+// counted as rendering time.
+
+struct StyleStats {
+    StyleStats(std::string const& name)
+        : name(name), time(0), fetched(0), rendered(0), symbolizers(0) {}
+
+    std::string name;
+    double time;
+    std::size_t fetched;     // features read from the datasource
+    std::size_t rendered;    // features that matched at least one rule
+    std::size_t symbolizers; // symbolizers applied to features
+};
+
+struct LayerStats {
+    LayerStats(std::string const& name) : name(name) {}
+
+    std::string name;
+    std::vector<StyleStats> styles;
+};
+
+class CountingFeatureset : public mapnik::Featureset {
+public:
+    CountingFeatureset(mapnik::featureset_ptr features, StyleStats& stats,
+                       std::vector<mapnik::feature_ptr>& seen)
+        : features_(features), stats_(stats), seen_(seen) {}
+
+    mapnik::feature_ptr next()
+    {
+        mapnik::feature_ptr feature = features_->next();
+        if (feature) {
+            stats_.fetched++;
+            seen_.push_back(feature);
+        }
+        return feature;
+    }
+
+private:
+    mapnik::featureset_ptr features_;
+    StyleStats& stats_;
+    std::vector<mapnik::feature_ptr>& seen_;
+};
+
+// Applies the rules to the features the same way feature_style_processor
+// does, with the same variables as the render, and counts the features
+// rendered and the symbolizers applied
+static void
+count_rendered(std::vector<mapnik::feature_ptr> const& features,
+               std::vector<mapnik::rule const*> const& rules,
+               mapnik::feature_type_style const& style,
+               mapnik::attributes const& vars, StyleStats& stats)
+{
+    for (mapnik::feature_ptr const& feature : features) {
+        bool do_else = true;
+        bool do_also = false;
+        std::size_t symbolizers = 0;
+
+        for (mapnik::rule const* rule : rules) {
+            if (rule->has_else_filter() || rule->has_also_filter())
+                continue;
+            mapnik::value_type result = mapnik::util::apply_visitor(
+                mapnik::evaluate<mapnik::feature_impl, mapnik::value_type, mapnik::attributes>(*feature, vars),
+                *rule->get_filter());
+            if (result.to_bool()) {
+                do_else = false;
+                do_also = true;
+                symbolizers += rule->get_symbolizers().size();
+                if (style.get_filter_mode() == mapnik::FILTER_FIRST)
+                    break;
+            }
+        }
+        for (mapnik::rule const* rule : rules) {
+            if ((do_else && rule->has_else_filter()) ||
+                (do_also && rule->has_also_filter()))
+                symbolizers += rule->get_symbolizers().size();
+        }
+
+        if (symbolizers > 0) {
+            stats.rendered++;
+            stats.symbolizers += symbolizers;
+        }
+    }
+}
+
+class CountingDatasource : public mapnik::datasource {
+public:
+    CountingDatasource(mapnik::datasource_ptr source, StyleStats& stats,
+                       std::vector<mapnik::feature_ptr>& seen)
+        : mapnik::datasource(source->params()), source_(source),
+          stats_(stats), seen_(seen) {}
+
+    datasource_t type() const
+    {
+        return source_->type();
+    }
+
+    mapnik::processor_context_ptr get_context(mapnik::feature_style_context_map& ctx) const
+    {
+        return source_->get_context(ctx);
+    }
+
+    mapnik::featureset_ptr features_with_context(mapnik::query const& q, mapnik::processor_context_ptr ctx) const
+    {
+        return wrap(source_->features_with_context(q, ctx));
+    }
+
+    mapnik::featureset_ptr features(mapnik::query const& q) const
+    {
+        return wrap(source_->features(q));
+    }
+
+    mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt, double tol) const
+    {
+        return source_->features_at_point(pt, tol);
+    }
+
+    mapnik::box2d<double> envelope() const
+    {
+        return source_->envelope();
+    }
+
+    boost::optional<mapnik::datasource_geometry_t> get_geometry_type() const
+    {
+        return source_->get_geometry_type();
+    }
+
+    mapnik::layer_descriptor get_descriptor() const
+    {
+        return source_->get_descriptor();
+    }
+
+private:
+    mapnik::featureset_ptr wrap(mapnik::featureset_ptr features) const
+    {
+        if (!features || !mapnik::is_valid(features))
+            return features;
+        return std::make_shared<CountingFeatureset>(features, stats_, seen_);
+    }
+
+    mapnik::datasource_ptr source_;
+    StyleStats& stats_;
+    std::vector<mapnik::feature_ptr>& seen_;
+};
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Renders the map into the image as described above, returning the
+// statistics for each layer that was rendered
+static std::vector<LayerStats>
+render_with_stats(mapnik::Map const& map, mapnik::request const& view,
+                  mapnik::image_rgba8& image)
+{
+    reset_image(image, view.width(), view.height());
+
+    // first a pass with no layers, which just paints the background
+    mapnik::Map pass(view.width(), view.height(), map.srs());
+    if (map.background())
+        pass.set_background(*map.background());
+    if (map.background_image()) {
+        pass.set_background_image(*map.background_image());
+        pass.set_background_image_comp_op(map.background_image_comp_op());
+        pass.set_background_image_opacity(map.background_image_opacity());
+    }
+    pass.set_base_path(map.base_path());
+    pass.zoom_to_box(view.extent());
+    {
+        mapnik::agg_renderer<mapnik::image_rgba8> ren(pass, image);
+        ren.apply();
+    }
+
+    // then the map that does the real passes, without the background
+    pass = mapnik::Map(view.width(), view.height(), map.srs());
+    pass.set_buffer_size(view.buffer_size());
+    pass.set_base_path(map.base_path());
+    if (map.font_directory())
+        pass.set_font_directory(*map.font_directory());
+    for (auto const& fontset : map.fontsets())
+        pass.insert_fontset(fontset.first, fontset.second);
+    pass.zoom_to_box(view.extent());
+
+    int buffer = view.buffer_size();
+    auto detector = std::make_shared<mapnik::label_collision_detector4>(
+        mapnik::box2d<double>(-buffer, -buffer, view.width() + buffer, view.height() + buffer));
+
+    mapnik::projection proj(map.srs(), true);
+    double scale_denom = mapnik::scale_denominator(view.scale(), proj.is_geographic());
+
+    // the variables filters are evaluated with: a renderer given a
+    // detector has none of its own, so these are empty as well
+    mapnik::attributes vars;
+    std::vector<mapnik::feature_ptr> seen;
+
+    std::vector<LayerStats> stats;
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (!lyr.visible(scale_denom) || !lyr.datasource())
+            continue;
+
+        stats.emplace_back(lyr.name());
+        LayerStats& layer_stats = stats.back();
+        bool first = true;
+        for (std::string const& name : lyr.styles()) {
+            auto found = map.styles().find(name);
+            if (found == map.styles().end())
+                continue;
+            mapnik::feature_type_style const& style = found->second;
+
+            std::vector<mapnik::rule const*> rules;
+            for (mapnik::rule const& rule : style.get_rules())
+                if (rule.active(scale_denom))
+                    rules.push_back(&rule);
+
+            layer_stats.styles.emplace_back(name);
+            StyleStats& style_stats = layer_stats.styles.back();
+
+            mapnik::layer single(lyr);
+            single.styles().assign(1, name);
+            single.set_clear_label_cache(first && lyr.clear_label_cache());
+            single.set_datasource(std::make_shared<CountingDatasource>(lyr.datasource(), style_stats, seen));
+            pass.layers().clear();
+            pass.add_layer(single);
+            pass.insert_style(name, style);
+            first = false;
+
+            auto start = std::chrono::steady_clock::now();
+            mapnik::agg_renderer<mapnik::image_rgba8> ren(pass, image, detector);
+            ren.apply();
+            style_stats.time = seconds_since(start);
+
+            count_rendered(seen, rules, style, vars, style_stats);
+            seen.clear();
+        }
+    }
+    return stats;
+}
+
+
+// ===========================================================================
+// WORKER POOL
+
+// A fixed set of native threads that run tasks. Every worker has its own
+// deque of tasks. It takes tasks from the front of its own deque, and when
+// that is empty it steals from the back of the others', so all threads stay
+// busy even when some tiles take much longer than others. Each worker has
+// its own scratch image, which it passes to every task it runs.
+//
+// Workers never touch Python objects, so they don't need the GIL.
+
+class WorkerPool {
+public:
+    typedef std::function<void(mapnik::image_rgba8&)> Task;
+
+    WorkerPool(unsigned threads)
+        : pending_(0), next_(0), stopping_(false)
+    {
+        for (unsigned ix = 0; ix < threads; ix++)
+            queues_.emplace_back(new Queue());
+
+        // if a thread can't be started, the ones already running must be
+        // stopped before the exception leaves, or they'd never be joined
+        try {
+            for (unsigned ix = 0; ix < threads; ix++)
+                threads_.emplace_back(&WorkerPool::run, this, ix);
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    // finishes the tasks already submitted before stopping
+    ~WorkerPool()
+    {
+        stop();
+    }
+
+    unsigned size() const
+    {
+        return threads_.size();
+    }
+
+    // spreads the tasks round robin over the workers' deques
+    void submit(std::vector<Task>& tasks)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (Task& task : tasks) {
+            Queue& queue = *queues_[next_++ % queues_.size()];
+            std::lock_guard<std::mutex> qguard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        pending_ += tasks.size();
+        wakeup_.notify_all();
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+        }
+        wakeup_.notify_all();
+        for (auto& thread : threads_)
+            thread.join();
+    }
+
+    bool take(unsigned worker, Task& task)
+    {
+        for (unsigned ix = 0; ix < queues_.size(); ix++) {
+            Queue& queue = *queues_[(worker + ix) % queues_.size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+
+            if (ix == 0) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            } else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(unsigned worker)
+    {
+        mapnik::image_rgba8 scratch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(lock_);
+                wakeup_.wait(guard, [this] { return pending_ > 0 || stopping_; });
+                if (pending_ == 0)
+                    return;
+                // claiming a task here guarantees that there is one
+                // left in some deque for us to take
+                pending_--;
+            }
+
+            Task task;
+            while (!take(worker, task))
+                std::this_thread::yield();
+            task(scratch);
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex lock_;
+    std::condition_variable wakeup_;
+    std::size_t pending_;
+    std::size_t next_;
+    bool stopping_;
+};
+
+// The state of one batch of tasks. The workers store results and report
+// them as finished, while the thread that submitted the batch waits for
+// them.
+struct Batch {
+    Batch(std::size_t count, std::size_t tasks)
+        : results(count), outstanding(tasks), cancelled(false), failed(false) {}
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<std::string> results;
+    std::deque<std::size_t> finished; // results not yet passed on
+    std::size_t outstanding;          // tasks not yet completed
+    bool cancelled;
+    bool failed;
+    std::string error;
+
+    // called by a task when it's done, with the results it produced
+    void complete(std::vector<std::pair<std::size_t, std::string>>& done,
+                  bool task_failed, std::string const& task_error)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& result : done) {
+            results[result.first] = std::move(result.second);
+            finished.push_back(result.first);
+        }
+        if (task_failed && !failed) {
+            failed = true;
+            cancelled = true;
+            error = task_error;
+        }
+        outstanding--;
+        changed.notify_all();
+    }
+
+    bool is_cancelled()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return cancelled;
+    }
+
+    void cancel()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        cancelled = true;
+    }
+
+    // blocks until some results are finished or all tasks are done,
+    // moving the indexes of the finished results into ready. Returns true
+    // when all tasks are done. Must be called without the GIL.
+    bool wait(std::vector<std::size_t>& ready)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this] { return !finished.empty() || outstanding == 0; });
+        ready.assign(finished.begin(), finished.end());
+        finished.clear();
+        return outstanding == 0;
+    }
+
+    // does the same as wait, except it returns at once
+    bool poll(std::vector<std::size_t>& ready)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.assign(finished.begin(), finished.end());
+        finished.clear();
+        return outstanding == 0;
+    }
+};
+
+// Submits the tasks and waits for the batch to complete with the GIL
+// released. If callback isn't NULL it's called as callback(item, data)
+// with items[ix] for each result as it's finished. Returns false with a
+// Python error set if rendering or the callback failed.
+static bool
+run_batch(WorkerPool& pool, Batch& batch, std::vector<WorkerPool::Task>& tasks,
+          std::vector<PyObject*> const& items, PyObject* callback)
+{
+    pool.submit(tasks);
+
+    bool callback_failed = false;
+    bool all_done = false;
+    std::vector<std::size_t> ready;
+    while (!all_done) {
+        Py_BEGIN_ALLOW_THREADS
+        all_done = batch.wait(ready);
+        Py_END_ALLOW_THREADS
+
+        if (callback == NULL || callback_failed)
+            continue;
+
+        for (std::size_t ix : ready) {
+            std::string& data = batch.results[ix];
+            PyObject* value = PyBytes_FromStringAndSize(data.data(), data.size());
+            PyObject* ret = PyObject_CallFunctionObjArgs(callback, items[ix], value, NULL);
+            Py_DECREF(value);
+            if (ret == NULL) {
+                // tasks already running must still complete before we
+                // can return, but the rest are skipped
+                callback_failed = true;
+                batch.cancel();
+                break;
+            }
+            Py_DECREF(ret);
+            std::string().swap(data);
+        }
+    }
+
+    if (callback_failed)
+        return false;
+    if (batch.failed) {
+        PyErr_SetString(MapnikError, batch.error.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Returns the results of the batch as a list of bytes objects
+static PyObject*
+batch_results(Batch& batch)
+{
+    PyObject* result = PyList_New(batch.results.size());
+    for (std::size_t ix = 0; ix < batch.results.size(); ix++) {
+        std::string const& data = batch.results[ix];
+        PyList_SET_ITEM(result, ix, PyBytes_FromStringAndSize(data.data(), data.size()));
+    }
+    return result;
+}
+
+// Passes the results of a batch to the callback in the order of the
+// items, holding back results that finish before those ahead of them.
+// Must be used with the GIL.
+class OrderedResults {
+public:
+    OrderedResults(Batch& batch, std::vector<PyObject*> const& items, PyObject* callback)
+        : batch_(batch), items_(items), callback_(callback),
+          finished_(items.size(), false), next_(0), failed_(false) {}
+
+    // takes the indexes of newly finished results, as from Batch::wait
+    void deliver(std::vector<std::size_t> const& ready)
+    {
+        for (std::size_t ix : ready)
+            finished_[ix] = true;
+        if (callback_ == NULL || failed_)
+            return;
+
+        while (next_ < finished_.size() && finished_[next_]) {
+            std::string& data = batch_.results[next_];
+            PyObject* value = PyBytes_FromStringAndSize(data.data(), data.size());
+            PyObject* ret = PyObject_CallFunctionObjArgs(callback_, items_[next_], value, NULL);
+            Py_DECREF(value);
+            if (ret == NULL) {
+                failed_ = true;
+                batch_.cancel();
+                return;
+            }
+            Py_DECREF(ret);
+            std::string().swap(data);
+            next_++;
+        }
+    }
+
+    // true if the callback raised an exception
+    bool failed() const
+    {
+        return failed_;
+    }
+
+private:
+    Batch& batch_;
+    std::vector<PyObject*> const& items_;
+    PyObject* callback_;
+    std::vector<bool> finished_;
+    std::size_t next_;
+    bool failed_;
+};
+
+// A fixed number of images that are handed out and given back, so that
+// whoever fills them can't get more than that many images ahead of
+// whoever empties them
+class ImageSlots {
+public:
+    ImageSlots(std::size_t count) : images_(count)
+    {
+        for (std::size_t ix = 0; ix < count; ix++)
+            free_.push_back(ix);
+    }
+
+    // blocks until an image is free. Must be called without the GIL.
+    std::size_t acquire()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        available_.wait(guard, [this] { return !free_.empty(); });
+        std::size_t slot = free_.back();
+        free_.pop_back();
+        return slot;
+    }
+
+    void release(std::size_t slot)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            free_.push_back(slot);
+        }
+        available_.notify_one();
+    }
+
+    mapnik::image_rgba8& image(std::size_t slot)
+    {
+        return images_[slot];
+    }
+
+private:
+    std::vector<mapnik::image_rgba8> images_;
+    std::vector<std::size_t> free_;
+    std::mutex lock_;
+    std::condition_variable available_;
+};
+
+
+// ===========================================================================
+// RENDER POOL
+
+// One render in a batch: either a metatile, with the position within it of
+// each requested tile, or an extent rendered at the map's own size
+struct RenderJob {
+    bool is_tile;
+    Metatile meta;
+    mapnik::box2d<double> box;
+    std::vector<std::pair<std::size_t, std::pair<int, int>>> tiles; // item -> (col, row)
+};
+
+static void
+render_job(mapnik::Map const& map, mapnik::request const& view, RenderJob const& job,
+           int size, int buffer, mapnik::image_rgba8& image)
+{
+    if (job.is_tile) {
+        render_request(map, metatile_request(map, job.meta, size, buffer), image);
+    } else {
+        mapnik::request req(view.width(), view.height(),
+                            fit_aspect(job.box, view.width(), view.height()));
+        req.set_buffer_size(buffer);
+        render_request(map, req, image);
+    }
+}
+
+static std::vector<std::pair<std::size_t, std::string>>
+encode_job(mapnik::image_rgba8 const& image, RenderJob const& job, int size,
+           ImageFormat const& format)
+{
+    std::vector<std::pair<std::size_t, std::string>> done;
+    if (job.is_tile) {
+        for (auto const& tile : job.tiles)
+            done.push_back(std::make_pair(tile.first, encode_tile(image, tile.second.first, tile.second.second, size, format)));
+    } else {
+        done.push_back(std::make_pair(job.tiles[0].first, encode_to_string(image, format)));
+    }
+    return done;
+}
+
+// Turns the items of the sequence, (z, x, y) tuples and Box2d objects,
+// into jobs in the order they first appear. Tiles in the same metatile
+// share a job. Returns false with a Python error set if an item is bad.
+static bool
+parse_jobs(PyObject* fast, int metatile, std::vector<PyObject*>& items,
+           std::vector<RenderJob>& jobs)
+{
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(fast);
+    std::map<std::tuple<int, int, int>, std::size_t> metatiles;
+    for (Py_ssize_t ix = 0; ix < count; ix++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(fast, ix);
+        items.push_back(item);
+        if (PyObject_IsInstance(item, (PyObject*) &BoxType)) {
+            RenderJob job;
+            job.is_tile = false;
+            job.box = *((MapnikBox2d*) item)->box;
+            job.tiles.push_back(std::make_pair(ix, std::make_pair(0, 0)));
+            jobs.push_back(job);
+            continue;
+        }
+
+        int z, x, y;
+        if (!PyArg_ParseTuple(item, "iii", &z, &x, &y) || !check_tile(z, x, y))
+            return false;
+
+        Metatile meta = metatile_for(z, x, y, metatile);
+        auto key = std::make_tuple(z, meta.x, meta.y);
+        auto found = metatiles.find(key);
+        if (found == metatiles.end()) {
+            RenderJob job;
+            job.is_tile = true;
+            job.meta = meta;
+            jobs.push_back(job);
+            found = metatiles.insert(std::make_pair(key, jobs.size() - 1)).first;
+        }
+        jobs[found->second].tiles.push_back(std::make_pair(ix, std::make_pair(x - meta.x, y - meta.y)));
+    }
+    return true;
+}
+
+typedef struct {
+    PyObject_HEAD
+    WorkerPool* pool;
+    MapnikMap* map;
+} MapnikRenderPool;
+
+static void
+RenderPool_dealloc(MapnikRenderPool *self)
+{
+    delete self->pool;
+    Py_XDECREF(self->map);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+RenderPool_init(MapnikRenderPool *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject* themap;
+    int threads = 0;
+
+    static char *kwlist[] = {"map", "threads", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist,
+                                     &themap, &threads))
+        return -1;
+
+    if (!PyObject_IsInstance(themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "RenderPool requires a map object");
+        return -1;
+    }
+
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    try {
+        self->pool = new WorkerPool(threads);
+    } catch (const std::system_error& ex) {
+        PyErr_Format(MapnikError, "could not start render threads: %s", ex.what());
+        return -1;
+    }
+    Py_INCREF(themap);
+    self->map = (MapnikMap*) themap;
+    return 0;
+}
+
+static PyMemberDef RenderPool_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+RenderPool_threads(MapnikRenderPool *self, PyObject *Py_UNUSED(ignored))
+{
+    return Py_BuildValue("I", self->pool->size());
+}
+
+static PyObject *
+RenderPool_render(MapnikRenderPool *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *seq, *callback = NULL;
+    int metatile = 1, buffer = 0, size = 256;
+    ImageFormat format("png");
+
+    static char *kwlist[] = {"tiles", "format", "metatile", "buffer", "size",
+                             "callback", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O&iiiO", kwlist,
+                                     &seq, image_format_converter, &format,
+                                     &metatile, &buffer,
+                                     &size, &callback))
+        return NULL;
+
+    if (callback == Py_None)
+        callback = NULL;
+    if (callback != NULL && !PyCallable_Check(callback)) {
+        PyErr_SetString(MapnikError, "callback must be callable");
+        return NULL;
+    }
+    if (!check_metatile(metatile, size, buffer))
+        return NULL;
+
+    PyObject* fast = PySequence_Fast(seq, "tiles must be a sequence");
+    if (fast == NULL)
+        return NULL;
+
+    std::vector<PyObject*> items;
+    std::vector<RenderJob> jobs;
+    if (!parse_jobs(fast, metatile, items, jobs)) {
+        Py_DECREF(fast);
+        return NULL;
+    }
+
+    Batch batch(items.size(), jobs.size());
+    const MapnikMap* themap = self->map;
+    std::vector<WorkerPool::Task> tasks;
+    for (RenderJob const& job : jobs) {
+        tasks.push_back([&batch, themap, job, size, buffer, format](mapnik::image_rgba8& image) {
+            std::vector<std::pair<std::size_t, std::string>> done;
+            bool failed = false;
+            std::string error;
+            if (!batch.is_cancelled()) {
+                try {
+                    with_map_read_locked(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+                        render_job(map, view, job, size, buffer, image);
+                    });
+                    done = encode_job(image, job, size, format);
+                } catch (const std::exception& ex) {
+                    failed = true;
+                    error = ex.what();
+                }
+            }
+            batch.complete(done, failed, error);
+        });
+    }
+
+    bool ok = run_batch(*self->pool, batch, tasks, items, callback);
+    Py_DECREF(fast);
+    if (!ok)
+        return NULL;
+
+    if (callback != NULL)
+        return Py_BuildValue("");
+    return batch_results(batch);
+}
+
+// Renders on the calling thread, with the GIL released, and encodes on
+// the pool's threads, so that encoding a tile overlaps rendering the next.
+// At most depth rendered images wait to be encoded at any time. The
+// callback is called in the order of the tiles, while rendering goes on.
+static PyObject *
+RenderPool_render_pipelined(MapnikRenderPool *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *seq, *callback = NULL;
+    int metatile = 1, buffer = 0, size = 256, depth = 2;
+    ImageFormat format("png");
+
+    static char *kwlist[] = {"tiles", "format", "metatile", "buffer", "size",
+                             "depth", "callback", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O&iiiiO", kwlist,
+                                     &seq, image_format_converter, &format,
+                                     &metatile, &buffer, &size, &depth,
+                                     &callback))
+        return NULL;
+
+    if (callback == Py_None)
+        callback = NULL;
+    if (callback != NULL && !PyCallable_Check(callback)) {
+        PyErr_SetString(MapnikError, "callback must be callable");
+        return NULL;
+    }
+    if (!check_metatile(metatile, size, buffer))
+        return NULL;
+    if (depth < 1) {
+        PyErr_SetString(MapnikError, "depth must be positive");
+        return NULL;
+    }
+
+    PyObject* fast = PySequence_Fast(seq, "tiles must be a sequence");
+    if (fast == NULL)
+        return NULL;
+
+    std::vector<PyObject*> items;
+    std::vector<RenderJob> jobs;
+    if (!parse_jobs(fast, metatile, items, jobs)) {
+        Py_DECREF(fast);
+        return NULL;
+    }
+
+    Batch batch(items.size(), jobs.size());
+    ImageSlots slots(depth);
+    OrderedResults ordered(batch, items, callback);
+    const MapnikMap* themap = self->map;
+
+    std::size_t submitted = 0;
+    for (; submitted < jobs.size(); submitted++) {
+        if (batch.is_cancelled())
+            break;
+
+        RenderJob const& job = jobs[submitted];
+        std::size_t slot = 0;
+        bool failed = false;
+        std::string error;
+        Py_BEGIN_ALLOW_THREADS
+        slot = slots.acquire();
+        try {
+            with_map_read_locked(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+                render_job(map, view, job, size, buffer, slots.image(slot));
+            });
+        } catch (const std::exception& ex) {
+            failed = true;
+            error = ex.what();
+        }
+        Py_END_ALLOW_THREADS
+
+        if (failed) {
+            slots.release(slot);
+            std::vector<std::pair<std::size_t, std::string>> none;
+            batch.complete(none, true, error);
+            submitted++;
+            break;
+        }
+
+        std::vector<WorkerPool::Task> tasks;
+        tasks.push_back([&batch, &slots, &job, slot, size, format](mapnik::image_rgba8&) {
+            std::vector<std::pair<std::size_t, std::string>> done;
+            bool failed = false;
+            std::string error;
+            if (!batch.is_cancelled()) {
+                try {
+                    done = encode_job(slots.image(slot), job, size, format);
+                } catch (const std::exception& ex) {
+                    failed = true;
+                    error = ex.what();
+                }
+            }
+            slots.release(slot);
+            batch.complete(done, failed, error);
+        });
+        self->pool->submit(tasks);
+
+        std::vector<std::size_t> ready;
+        batch.poll(ready);
+        ordered.deliver(ready);
+    }
+
+    // the jobs that were never started count as done
+    for (; submitted < jobs.size(); submitted++) {
+        std::vector<std::pair<std::size_t, std::string>> none;
+        batch.complete(none, false, "");
+    }
+
+    bool all_done = false;
+    std::vector<std::size_t> ready;
+    while (!all_done) {
+        Py_BEGIN_ALLOW_THREADS
+        all_done = batch.wait(ready);
+        Py_END_ALLOW_THREADS
+        ordered.deliver(ready);
+    }
+
+    Py_DECREF(fast);
+    if (ordered.failed())
+        return NULL;
+    if (batch.failed) {
+        PyErr_SetString(MapnikError, batch.error.c_str());
+        return NULL;
+    }
+
+    if (callback != NULL)
+        return Py_BuildValue("");
+    return batch_results(batch);
+}
+
+static PyMethodDef RenderPool_methods[] = {
+    {"render", (PyCFunction) RenderPool_render, METH_VARARGS | METH_KEYWORDS,
+     "Render a list of (z, x, y) tiles or Box2d extents on the pool's threads"
+    },
+    {"render_pipelined", (PyCFunction) RenderPool_render_pipelined, METH_VARARGS | METH_KEYWORDS,
+     "Render a list of tiles or extents on this thread, encoding them on the pool's threads"
+    },
+    {"threads", (PyCFunction) RenderPool_threads, METH_NOARGS,
+     "Return the number of threads"
+    },
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject RenderPoolType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "pymapnik3.RenderPool",
+    .tp_doc = PyDoc_STR("RenderPool objects"),
+    .tp_basicsize = sizeof(MapnikRenderPool),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) RenderPool_init,
+    .tp_dealloc = (destructor) RenderPool_dealloc,
+    .tp_members = RenderPool_members,
+    .tp_methods = RenderPool_methods,
+};
+
+
+// ===========================================================================
+// ASYNC RENDERING
+
+// render_async runs renders on a pool of native threads shared by the whole
+// module. When a render is done the worker takes the GIL just long enough
+// to schedule the future's result on the event loop.
+
+static WorkerPool* async_pool = NULL;
+static PyObject* resolve_future_func = NULL;
+
+// Called on the event loop's thread via call_soon_threadsafe. The future
+// may have been cancelled while the render was running.
+static PyObject *
+resolve_future(PyObject *self, PyObject *args)
+{
+    PyObject *future, *value;
+    int ok;
+    if (!PyArg_ParseTuple(args, "OpO", &future, &ok, &value))
+        return NULL;
+
+    PyObject* done = PyObject_CallMethod(future, "done", NULL);
+    if (done == NULL)
+        return NULL;
+    int is_done = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (is_done)
+        return Py_BuildValue("");
+
+    PyObject* ret;
+    if (ok) {
+        ret = PyObject_CallMethod(future, "set_result", "O", value);
+    } else {
+        PyObject* error = PyObject_CallFunctionObjArgs(MapnikError, value, NULL);
+        if (error == NULL)
+            return NULL;
+        ret = PyObject_CallMethod(future, "set_exception", "O", error);
+        Py_DECREF(error);
+    }
+    if (ret == NULL)
+        return NULL;
+    Py_DECREF(ret);
+    return Py_BuildValue("");
+}
+
+static PyMethodDef resolve_future_def = {
+    "_resolve_future", resolve_future, METH_VARARGS,
+    "Set the result of a render_async future"
+};
+
+// Sets up the pool and the resolve function the first time they're needed.
+// Must be called with the GIL.
+static bool
+init_async()
+{
+    if (resolve_future_func == NULL) {
+        resolve_future_func = PyCFunction_New(&resolve_future_def, NULL);
+        if (resolve_future_func == NULL)
+            return false;
+    }
+    if (async_pool == NULL) {
+        try {
+            async_pool = new WorkerPool(std::max(1u, std::thread::hardware_concurrency()));
+        } catch (const std::system_error& ex) {
+            PyErr_Format(MapnikError, "could not start render threads: %s", ex.what());
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// ===========================================================================
+// VECTOR TILES
+
+// Mapbox vector tiles (version 2) are written directly from the layers'
+// datasources, without going through the renderer. Geometries are
+// reprojected to the map's projection, which must be web mercator, then
+// scaled to tile coordinates, clipped to the tile plus a buffer and
+// rounded to integers. The protobuf encoding is done by hand, since the
+// format only needs a handful of message types.
+
+// Writes protobuf fields to a string. Nested messages are written to a
+// string of their own first, then added with bytes_field.
+class ProtobufWriter {
+public:
+    enum { VARINT = 0, FIXED64 = 1, LENGTH = 2 };
+
+    void varint(std::uint64_t value)
+    {
+        while (value >= 0x80) {
+            data_.push_back(char((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        data_.push_back(char(value));
+    }
+
+    void uint_field(int field, std::uint64_t value)
+    {
+        varint((field << 3) | VARINT);
+        varint(value);
+    }
+
+    void double_field(int field, double value)
+    {
+        varint((field << 3) | FIXED64);
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        for (int ix = 0; ix < 8; ix++)
+            data_.push_back(char((bits >> (ix * 8)) & 0xff));
+    }
+
+    void bytes_field(int field, std::string const& value)
+    {
+        varint((field << 3) | LENGTH);
+        varint(value.size());
+        data_ += value;
+    }
+
+    void packed_field(int field, std::vector<std::uint32_t> const& values)
+    {
+        ProtobufWriter packed;
+        for (std::uint32_t value : values)
+            packed.varint(value);
+        bytes_field(field, packed.data());
+    }
+
+    std::string const& data() const
+    {
+        return data_;
+    }
+
+private:
+    std::string data_;
+};
+
+enum MvtGeomType { MVT_UNKNOWN = 0, MVT_POINT = 1, MVT_LINESTRING = 2, MVT_POLYGON = 3 };
+
+struct TilePoint {
+    double x, y;
+};
+
+typedef std::vector<TilePoint> TilePath;
+
+// A feature's geometry in tile coordinates, clipped but not yet rounded.
+// Polygons are lists of rings, the first of each being the exterior.
+struct TileGeometry {
+    TileGeometry() : type(MVT_UNKNOWN) {}
+
+    MvtGeomType type;
+    std::vector<TilePoint> points;
+    std::vector<TilePath> lines;
+    std::vector<std::vector<TilePath>> polygons;
+};
+
+// Clips a line to the box with Liang-Barsky, so the parts that leave and
+// re-enter the box become separate lines
+static void
+clip_line(TilePath const& line, double min, double max, std::vector<TilePath>& out)
+{
+    TilePath current;
+    for (std::size_t ix = 1; ix < line.size(); ix++) {
+        TilePoint a = line[ix - 1], b = line[ix];
+        double dx = b.x - a.x, dy = b.y - a.y;
+        double t0 = 0, t1 = 1;
+        double p[4] = { -dx, dx, -dy, dy };
+        double q[4] = { a.x - min, max - a.x, a.y - min, max - a.y };
+        bool inside = true;
+        for (int edge = 0; edge < 4 && inside; edge++) {
+            if (p[edge] == 0) {
+                inside = q[edge] >= 0;
+            } else {
+                double t = q[edge] / p[edge];
+                if (p[edge] < 0)
+                    t0 = std::max(t0, t);
+                else
+                    t1 = std::min(t1, t);
+                inside = t0 <= t1;
+            }
+        }
+
+        if (!inside) {
+            if (current.size() > 1)
+                out.push_back(current);
+            current.clear();
+            continue;
+        }
+
+        TilePoint start = { a.x + t0 * dx, a.y + t0 * dy };
+        TilePoint end = { a.x + t1 * dx, a.y + t1 * dy };
+        if (current.empty() || t0 > 0) {
+            if (current.size() > 1)
+                out.push_back(current);
+            current.assign(1, start);
+        }
+        current.push_back(end);
+        if (t1 < 1) {
+            out.push_back(current);
+            current.clear();
+        }
+    }
+    if (current.size() > 1)
+        out.push_back(current);
+}
+
+// Clips a ring to the box with Sutherland-Hodgman. Where the ring goes
+// outside the box it's replaced by a stretch along the box's edge.
+static TilePath
+clip_ring(TilePath ring, double min, double max)
+{
+    for (int edge = 0; edge < 4 && !ring.empty(); edge++) {
+        auto inside = [&](TilePoint const& pt) {
+            switch (edge) {
+            case 0: return pt.x >= min;
+            case 1: return pt.x <= max;
+            case 2: return pt.y >= min;
+            default: return pt.y <= max;
+            }
+        };
+        auto intersect = [&](TilePoint const& a, TilePoint const& b) {
+            double bound = (edge == 0 || edge == 2) ? min : max;
+            double t = (edge < 2) ? (bound - a.x) / (b.x - a.x) : (bound - a.y) / (b.y - a.y);
+            TilePoint pt = { a.x + t * (b.x - a.x), a.y + t * (b.y - a.y) };
+            return pt;
+        };
+
+        TilePath input;
+        input.swap(ring);
+        for (std::size_t ix = 0; ix < input.size(); ix++) {
+            TilePoint const& current = input[ix];
+            TilePoint const& previous = input[(ix + input.size() - 1) % input.size()];
+            if (inside(current)) {
+                if (!inside(previous))
+                    ring.push_back(intersect(previous, current));
+                ring.push_back(current);
+            } else if (inside(previous)) {
+                ring.push_back(intersect(previous, current));
+            }
+        }
+    }
+    return ring;
+}
+
+// Converts mapnik geometries to tile coordinates and clips them. Points
+// that can't be reprojected are dropped.
+class TileGeometryBuilder {
+public:
+    TileGeometryBuilder(mapnik::proj_transform const& transform,
+                        mapnik::box2d<double> const& tile, int extent, int buffer,
+                        TileGeometry& out)
+        : transform_(transform), tile_(tile), extent_(extent),
+          min_(-buffer), max_(extent + buffer), out_(out) {}
+
+    void operator()(mapnik::geometry::geometry_empty const&) {}
+
+    void operator()(mapnik::geometry::point<double> const& pt)
+    {
+        TilePoint tp;
+        if (!to_tile(pt, tp) || tp.x < min_ || tp.x > max_ || tp.y < min_ || tp.y > max_)
+            return;
+        out_.type = MVT_POINT;
+        out_.points.push_back(tp);
+    }
+
+    void operator()(mapnik::geometry::multi_point<double> const& points)
+    {
+        for (auto const& pt : points)
+            (*this)(pt);
+    }
+
+    void operator()(mapnik::geometry::line_string<double> const& line)
+    {
+        out_.type = MVT_LINESTRING;
+        clip_line(to_tile(line), min_, max_, out_.lines);
+    }
+
+    void operator()(mapnik::geometry::multi_line_string<double> const& lines)
+    {
+        for (auto const& line : lines)
+            (*this)(line);
+    }
+
+    void operator()(mapnik::geometry::polygon<double> const& polygon)
+    {
+        out_.type = MVT_POLYGON;
+        std::vector<TilePath> rings;
+        for (auto const& ring : polygon) {
+            TilePath clipped = clip_ring(to_tile(ring), min_, max_);
+            if (rings.empty() && clipped.size() < 3)
+                return; // the exterior is outside the tile, so are the holes
+            if (clipped.size() >= 3)
+                rings.push_back(clipped);
+        }
+        if (!rings.empty())
+            out_.polygons.push_back(rings);
+    }
+
+    void operator()(mapnik::geometry::multi_polygon<double> const& polygons)
+    {
+        for (auto const& polygon : polygons)
+            (*this)(polygon);
+    }
+
+    // MVT features have a single type, so of a mixed collection only the
+    // parts of the first type seen are kept
+    void operator()(mapnik::geometry::geometry_collection<double> const& collection)
+    {
+        for (auto const& geom : collection) {
+            TileGeometry part;
+            TileGeometryBuilder builder(transform_, tile_, extent_, max_ - extent_, part);
+            mapnik::util::apply_visitor(builder, geom);
+            if (part.type == MVT_UNKNOWN || (out_.type != MVT_UNKNOWN && part.type != out_.type))
+                continue;
+            out_.type = part.type;
+            out_.points.insert(out_.points.end(), part.points.begin(), part.points.end());
+            out_.lines.insert(out_.lines.end(), part.lines.begin(), part.lines.end());
+            out_.polygons.insert(out_.polygons.end(), part.polygons.begin(), part.polygons.end());
+        }
+    }
+
+private:
+    bool to_tile(mapnik::geometry::point<double> const& pt, TilePoint& out) const
+    {
+        double x = pt.x, y = pt.y, z = 0;
+        if (!transform_.backward(x, y, z))
+            return false;
+        out.x = (x - tile_.minx()) / tile_.width() * extent_;
+        out.y = (tile_.maxy() - y) / tile_.height() * extent_;
+        return true;
+    }
+
+    template <typename Points>
+    TilePath to_tile(Points const& points) const
+    {
+        TilePath path;
+        TilePoint tp;
+        for (auto const& pt : points)
+            if (to_tile(pt, tp))
+                path.push_back(tp);
+        return path;
+    }
+
+    mapnik::proj_transform const& transform_;
+    mapnik::box2d<double> tile_;
+    int extent_;
+    double min_, max_;
+    TileGeometry& out_;
+};
+
+static std::uint32_t
+mvt_command(int id, std::size_t count)
+{
+    return (id & 0x7) | (std::uint32_t(count) << 3);
+}
+
+static std::uint32_t
+zigzag(std::int64_t value)
+{
+    return std::uint32_t((value << 1) ^ (value >> 63));
+}
+
+// Builds the geometry commands of a feature, keeping track of the cursor,
+// which carries over from one part of the feature to the next
+class MvtCommands {
+public:
+    MvtCommands() : x_(0), y_(0) {}
+
+    // rounds the path to integers and drops repeated points
+    static std::vector<std::pair<std::int64_t, std::int64_t>> round(TilePath const& path)
+    {
+        std::vector<std::pair<std::int64_t, std::int64_t>> out;
+        for (TilePoint const& pt : path) {
+            auto rounded = std::make_pair(std::int64_t(std::llround(pt.x)), std::int64_t(std::llround(pt.y)));
+            if (out.empty() || out.back() != rounded)
+                out.push_back(rounded);
+        }
+        return out;
+    }
+
+    void points(std::vector<TilePoint> const& points)
+    {
+        if (points.empty())
+            return;
+        commands_.push_back(mvt_command(1, points.size()));
+        for (TilePoint const& pt : points)
+            move(std::llround(pt.x), std::llround(pt.y));
+    }
+
+    void line(TilePath const& path)
+    {
+        auto rounded = round(path);
+        if (rounded.size() < 2)
+            return;
+        commands_.push_back(mvt_command(1, 1));
+        move(rounded[0].first, rounded[0].second);
+        commands_.push_back(mvt_command(2, rounded.size() - 1));
+        for (std::size_t ix = 1; ix < rounded.size(); ix++)
+            move(rounded[ix].first, rounded[ix].second);
+    }
+
+    // Rings must have positive area in tile coordinates if they're
+    // exterior, negative if they're holes, so they're reversed if need be.
+    // Returns false if the ring collapsed when rounded.
+    bool ring(TilePath const& path, bool exterior)
+    {
+        auto rounded = round(path);
+        if (rounded.size() > 1 && rounded.front() == rounded.back())
+            rounded.pop_back();
+        if (rounded.size() < 3)
+            return false;
+
+        std::int64_t area = 0;
+        for (std::size_t ix = 0; ix < rounded.size(); ix++) {
+            auto const& a = rounded[ix];
+            auto const& b = rounded[(ix + 1) % rounded.size()];
+            area += a.first * b.second - b.first * a.second;
+        }
+        if (area == 0)
+            return false;
+        if ((area > 0) != exterior)
+            std::reverse(rounded.begin(), rounded.end());
+
+        commands_.push_back(mvt_command(1, 1));
+        move(rounded[0].first, rounded[0].second);
+        commands_.push_back(mvt_command(2, rounded.size() - 1));
+        for (std::size_t ix = 1; ix < rounded.size(); ix++)
+            move(rounded[ix].first, rounded[ix].second);
+        commands_.push_back(mvt_command(7, 1));
+        return true;
+    }
+
+    std::vector<std::uint32_t> const& commands() const
+    {
+        return commands_;
+    }
+
+private:
+    void move(std::int64_t x, std::int64_t y)
+    {
+        commands_.push_back(zigzag(x - x_));
+        commands_.push_back(zigzag(y - y_));
+        x_ = x;
+        y_ = y;
+    }
+
+    std::vector<std::uint32_t> commands_;
+    std::int64_t x_, y_;
+};
+
+static std::vector<std::uint32_t>
+mvt_geometry(TileGeometry const& geom)
+{
+    MvtCommands commands;
+    commands.points(geom.points);
+    for (TilePath const& line : geom.lines)
+        commands.line(line);
+    for (auto const& rings : geom.polygons) {
+        if (!commands.ring(rings[0], true))
+            continue;
+        for (std::size_t ix = 1; ix < rings.size(); ix++)
+            commands.ring(rings[ix], false);
+    }
+    return commands.commands();
+}
+
+// Encodes an attribute value as a Value message. Returns false for null,
+// which MVT has no way to represent.
+static bool
+mvt_value(mapnik::value const& value, std::string& out)
+{
+    ProtobufWriter writer;
+    if (value.is<mapnik::value_null>())
+        return false;
+    else if (value.is<mapnik::value_bool>())
+        writer.uint_field(7, value.get<mapnik::value_bool>() ? 1 : 0);
+    else if (value.is<mapnik::value_integer>())
+        writer.uint_field(4, std::uint64_t(value.get<mapnik::value_integer>()));
+    else if (value.is<mapnik::value_double>())
+        writer.double_field(3, value.get<mapnik::value_double>());
+    else
+        writer.bytes_field(1, value.to_string());
+    out = writer.data();
+    return true;
+}
+
+// Collects the features of one layer, sharing keys and values between
+// them
+class MvtLayerBuilder {
+public:
+    MvtLayerBuilder(std::string const& name, int extent)
+        : name_(name), extent_(extent), count_(0) {}
+
+    void add(mapnik::feature_impl const& feature, TileGeometry const& geom)
+    {
+        std::vector<std::uint32_t> commands = mvt_geometry(geom);
+        if (commands.empty())
+            return;
+
+        std::vector<std::uint32_t> tags;
+        for (auto const& kv : feature) {
+            std::string value;
+            if (!mvt_value(std::get<1>(kv), value))
+                continue;
+            tags.push_back(index(keys_, key_order_, std::get<0>(kv)));
+            tags.push_back(index(values_, value_order_, value));
+        }
+
+        ProtobufWriter writer;
+        if (feature.id() >= 0)
+            writer.uint_field(1, feature.id());
+        if (!tags.empty())
+            writer.packed_field(2, tags);
+        writer.uint_field(3, geom.type);
+        writer.packed_field(4, commands);
+        features_.bytes_field(2, writer.data());
+        count_++;
+    }
+
+    bool empty() const
+    {
+        return count_ == 0;
+    }
+
+    std::string encode() const
+    {
+        ProtobufWriter writer;
+        writer.uint_field(15, 2);
+        writer.bytes_field(1, name_);
+        std::string data = writer.data() + features_.data();
+
+        ProtobufWriter rest;
+        for (std::string const& key : key_order_)
+            rest.bytes_field(3, key);
+        for (std::string const& value : value_order_)
+            rest.bytes_field(4, value);
+        rest.uint_field(5, extent_);
+        return data + rest.data();
+    }
+
+private:
+    static std::uint32_t index(std::map<std::string, std::uint32_t>& indexes,
+                               std::vector<std::string>& order,
+                               std::string const& item)
+    {
+        auto found = indexes.find(item);
+        if (found != indexes.end())
+            return found->second;
+        std::uint32_t ix = order.size();
+        indexes[item] = ix;
+        order.push_back(item);
+        return ix;
+    }
+
+    std::string name_;
+    int extent_;
+    std::size_t count_;
+    ProtobufWriter features_;
+    std::map<std::string, std::uint32_t> keys_, values_;
+    std::vector<std::string> key_order_, value_order_;
+};
+
+// Queries every visible layer for the tile and returns the encoded tile.
+// Layers without features in the tile are left out.
+static std::string
+render_mvt(mapnik::Map const& map, int z, int x, int y, int extent, int buffer)
+{
+    check_mercator(map);
+    Metatile meta = { z, x, y, 1, 1 };
+    mapnik::box2d<double> tile = meta.extent();
+    double margin = tile.width() * buffer / extent;
+    mapnik::box2d<double> buffered(tile.minx() - margin, tile.miny() - margin,
+                                   tile.maxx() + margin, tile.maxy() + margin);
+
+    mapnik::projection map_proj(map.srs(), true);
+    double scale_denom = mapnik::scale_denominator(tile.width() / 256, map_proj.is_geographic());
+
+    ProtobufWriter writer;
+    for (mapnik::layer const& lyr : map.layers()) {
+        if (!lyr.visible(scale_denom) || !lyr.datasource())
+            continue;
+
+        mapnik::projection layer_proj(lyr.srs(), true);
+        mapnik::proj_transform transform(map_proj, layer_proj);
+        mapnik::box2d<double> query_box(buffered);
+        if (!transform.forward(query_box, 20) || !query_box.intersects(layer_extent(lyr)))
+            continue;
+
+        double resolution = extent / tile.width();
+        mapnik::query q(query_box, mapnik::query::resolution_type(resolution, resolution), scale_denom);
+        mapnik::datasource_ptr ds = lyr.datasource();
+        for (auto const& attribute : ds->get_descriptor().get_descriptors())
+            q.add_property_name(attribute.get_name());
+
+        MvtLayerBuilder builder(lyr.name(), extent);
+        mapnik::featureset_ptr features = ds->features(q);
+        if (!features || !mapnik::is_valid(features))
+            continue;
+        while (mapnik::feature_ptr feature = features->next()) {
+            TileGeometry geom;
+            TileGeometryBuilder converter(transform, tile, extent, buffer, geom);
+            mapnik::util::apply_visitor(converter, feature->get_geometry());
+            if (geom.type != MVT_UNKNOWN)
+                builder.add(*feature, geom);
+        }
+
+        if (!builder.empty())
+            writer.bytes_field(3, builder.encode());
+    }
+    return writer.data();
+}
+
+// ===========================================================================
+// FUNCTIONS
+
+static PyObject *
+mapnik_clear_expression_cache(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    std::lock_guard<std::mutex> guard(expression_cache_lock);
+    expression_cache.clear();
+    expression_cache_hits = 0;
+    expression_cache_misses = 0;
+    return Py_BuildValue("");
+}
+
+static PyObject *
+mapnik_clear_map_cache(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    std::lock_guard<std::mutex> guard(map_cache_lock);
+    map_cache.clear();
+    map_cache_order.clear();
+    return Py_BuildValue("");
+}
+
+static PyObject *
+mapnik_expression_cache_stats(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    std::lock_guard<std::mutex> guard(expression_cache_lock);
+    return Py_BuildValue("{s:n,s:n,s:n}",
+                         "size", (Py_ssize_t) expression_cache.size(),
+                         "hits", (Py_ssize_t) expression_cache_hits,
+                         "misses", (Py_ssize_t) expression_cache_misses);
+}
+
+// The source is taken to be XML if it starts with '<', otherwise a file
+// name
+static PyObject *
+mapnik_load_map(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    MapnikMap* themap;
+    const char *source;
+    int strict = 0;
+    const char *base_path = "";
+
+    static char *kwlist[] = {"map", "source", "strict", "base_path", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os|ps", kwlist,
+                                     &themap, &source, &strict, &base_path))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "load_map requires a map object");
+        return NULL;
+    }
+
+    std::string c_source(source);
+    std::string c_base_path(base_path);
+    std::size_t start = c_source.find_first_not_of(" \t\r\n");
+    bool is_file = start == std::string::npos || c_source[start] != '<';
+
+    std::shared_ptr<const mapnik::Map> parsed;
+    bool ok = true;
+    std::string error;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        parsed = parsed_map(c_source, is_file, strict, c_base_path);
+    } catch (const std::exception& ex) {
+        ok = false;
+        error = ex.what();
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(MapnikError, error.c_str());
+        return NULL;
+    }
+
+    MapState* state = themap->state;
+    ExclusiveLock lock(state->lock);
+    Py_BEGIN_ALLOW_THREADS
+    merge_map(state->writable(), *parsed);
+    state->buffer_size = parsed->buffer_size();
+    state->generation++;
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("");
+}
+
+static PyObject *
+mapnik_parse_from_geojson(PyObject *self, PyObject *args)
+{
+    char* c_json;
+    PyObject* c_ctx;
+    if (!PyArg_ParseTuple(args, "sO", &c_json, &c_ctx))
+        return NULL;
+
+    if (!PyObject_IsInstance(c_ctx, (PyObject*) &ContextType)) {
+        PyErr_SetString(MapnikError, "second argument to from_geojson must be context object");
+        return NULL;
+    }
+
+    MapnikContext* ctx = (MapnikContext*) c_ctx;
+    mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx->context, 1));
+    if (!mapnik::json::from_geojson(std::string(c_json), *feature)) {
+        PyErr_SetString(MapnikError, "Failed to parse geojson feature");
+        return NULL;
+    }
+
+    PyObject *argList = Py_BuildValue("()");
+    MapnikFeature* featureobj = (MapnikFeature*) PyObject_CallObject((PyObject *) &FeatureType, argList);
+    Py_DECREF(argList);
+
+    featureobj->feature = feature;
+    PyObject* pyfeature = (PyObject*) featureobj;
+    return Py_BuildValue("O", pyfeature);
+}
+
+static PyObject *
+mapnik_register_datasources(PyObject *self, PyObject *args)
+{
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    mapnik::datasource_cache::instance().register_datasources(std::string(path));
+    return Py_BuildValue("");
+}
+
+static PyObject *
+mapnik_register_font(PyObject *self, PyObject *args)
+{
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    mapnik::freetype_engine::register_font(path);
+    return Py_BuildValue("");
+}
+
+static PyObject *
+mapnik_render_to_file(PyObject *self, PyObject *args)
+{
+    const char *filename;
+    ImageFormat format;
+    const MapnikMap* themap;
+
+    if (!PyArg_ParseTuple(args, "OsO&", &themap, &filename, image_format_converter, &format))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_to_file requires a map object");
+        return NULL;
+    }
+
+    std::string c_filename(filename);
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+#ifdef HAVE_CAIRO
+        if (is_cairo_format(format.format)) {
+            std::ofstream file(c_filename, std::ios::binary | std::ios::trunc);
+            if (!file)
+                throw std::runtime_error("could not open " + c_filename);
+            render_cairo_to_stream(map, view, format.format, file);
+            return;
+        }
+#endif
+
+        mapnik::image_rgba8 local;
+        mapnik::image_rgba8& image = scratch_image(local);
+        render_request(map, view, image);
+        encode_to_file(image, c_filename, format);
+    });
+    if (!ok)
+        return NULL;
+
+    return Py_BuildValue("");
+}
+
+// Checks the detector argument of the render functions, which is optional
+static bool
+check_detector(PyObject* detector, ImageFormat const& format)
+{
+    if (detector == NULL || detector == Py_None)
+        return true;
+    if (!PyObject_IsInstance(detector, (PyObject*) &LabelCollisionDetectorType)) {
+        PyErr_SetString(MapnikError, "detector must be a label collision detector object");
+        return false;
+    }
+#ifdef HAVE_CAIRO
+    if (is_cairo_format(format.format)) {
+        PyErr_SetString(MapnikError, "detector can't be used with svg or pdf output");
+        return false;
+    }
+#endif
+    return true;
+}
+
+static LabelBoxes*
+detector_labels(PyObject* detector)
+{
+    if (detector == NULL || detector == Py_None)
+        return NULL;
+    return ((MapnikLabelCollisionDetector*) detector)->labels;
+}
+
+static PyObject *
+mapnik_render_to_bytes(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    ImageFormat format;
+    const MapnikMap* themap;
+    PyObject* detector = NULL;
+
+    static char *kwlist[] = {"map", "format", "detector", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO&|O", kwlist,
+                                     &themap, image_format_converter, &format,
+                                     &detector))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_to_bytes requires a map object");
+        return NULL;
+    }
+
+    if (!check_detector(detector, format))
+        return NULL;
 
-typedef struct {
-    PyObject_HEAD
-    mapnik::Map* map;
-} MapnikMap;
+    LabelBoxes* labels = detector_labels(detector);
+    std::ostringstream stream;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        if (labels) {
+            std::unique_ptr<mapnik::Map> copy;
+            mapnik::image_rgba8 local;
+            mapnik::image_rgba8& image = scratch_image(local);
+            render_with_labels(map_with_view(map, view, copy), image, *labels);
+            encode_to_stream(image, stream, format);
+        } else {
+            render_to_stream(map, view, format, stream);
+        }
+    });
+    if (!ok)
+        return NULL;
 
-static void
-Map_dealloc(MapnikMap *self)
-{
-    delete self->map;
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    std::string data = stream.str();
+    return PyBytes_FromStringAndSize(data.data(), data.size());
 }
 
-static int
-Map_init(MapnikMap *self, PyObject *args)
+static PyObject *
+mapnik_render(PyObject *self, PyObject *args)
 {
-    int width, height;
-    if (!PyArg_ParseTuple(args, "ii", &width, &height))
-        return -1;
+    const MapnikMap* themap;
+    MapnikImage* image;
 
-    self->map = new mapnik::Map(width, height);
+    if (!PyArg_ParseTuple(args, "OO", &themap, &image))
+        return NULL;
 
-    return 0;
-}
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render requires a map object");
+        return NULL;
+    }
+    if (!PyObject_IsInstance((PyObject*) image, (PyObject*) &ImageType)) {
+        PyErr_SetString(MapnikError, "render requires an image object");
+        return NULL;
+    }
 
-static PyMemberDef Map_members[] = {
-    {NULL}  /* Sentinel */
-};
+    // like agg_renderer, this renders over what's already in the image
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        if (image->image->width() != view.width() || image->image->height() != view.height())
+            throw std::runtime_error("image must be the same size as the map");
+        mapnik::attributes vars;
+        mapnik::agg_renderer<mapnik::image_rgba8> ren(map, view, vars, *image->image);
+        apply_request(ren, map, view);
+    });
+    if (!ok)
+        return NULL;
+
+    return Py_BuildValue("");
+}
 
 static PyObject *
-Map_add_layer(MapnikMap *self, PyObject* args)
+mapnik_render_dirty(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject* obj;
-    if (!PyArg_ParseTuple(args, "O", &obj))
+    const MapnikMap* themap;
+    MapnikImage* image;
+    PyObject* seq;
+    int buffer = 16;
+
+    static char *kwlist[] = {"map", "image", "boxes", "buffer", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|i", kwlist,
+                                     &themap, &image, &seq, &buffer))
         return NULL;
 
-    if (!PyObject_IsInstance(obj, (PyObject*) &LayerType)) {
-        PyErr_SetString(MapnikError, "add_layer requires a layer object");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_dirty requires a map object");
+        return NULL;
+    }
+    if (!PyObject_IsInstance((PyObject*) image, (PyObject*) &ImageType)) {
+        PyErr_SetString(MapnikError, "render_dirty requires an image object");
+        return NULL;
+    }
+    if (buffer < 0) {
+        PyErr_SetString(MapnikError, "buffer must be non-negative");
         return NULL;
     }
 
-    MapnikLayer *layer = (MapnikLayer *) obj;
-    self->map->add_layer(*layer->layer);
-    return Py_BuildValue("");
+    PyObject* fast = PySequence_Fast(seq, "boxes must be a sequence");
+    if (fast == NULL)
+        return NULL;
+
+    std::vector<mapnik::box2d<double>> boxes;
+    for (Py_ssize_t ix = 0; ix < PySequence_Fast_GET_SIZE(fast); ix++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(fast, ix);
+        if (!PyObject_IsInstance(item, (PyObject*) &BoxType)) {
+            Py_DECREF(fast);
+            PyErr_SetString(MapnikError, "boxes must be box objects");
+            return NULL;
+        }
+        boxes.push_back(*((MapnikBox2d*) item)->box);
+    }
+    Py_DECREF(fast);
+
+    std::size_t rendered = 0;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        if (image->image->width() != view.width() || image->image->height() != view.height())
+            throw std::runtime_error("image must be the same size as the map");
+        rendered = render_dirty(map, view, *image->image, boxes, buffer);
+    });
+    if (!ok)
+        return NULL;
+
+    return Py_BuildValue("n", (Py_ssize_t) rendered);
 }
 
 static PyObject *
-Map_add_style(MapnikMap *self, PyObject* args)
+mapnik_render_async(PyObject *self, PyObject *args)
 {
-    char *c_name;
-    MapnikStyle *style;
-    if (!PyArg_ParseTuple(args, "sO", &c_name, &style))
+    ImageFormat format("png");
+    MapnikMap* themap;
+
+    if (!PyArg_ParseTuple(args, "O|O&", &themap, image_format_converter, &format))
         return NULL;
 
-    if (!PyObject_IsInstance((PyObject*) style, (PyObject*) &StyleType)) {
-        PyErr_SetString(MapnikError, "add_style requires a style object");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_async requires a map object");
         return NULL;
     }
+    if (!init_async())
+        return NULL;
 
-    self->map->insert_style(std::string(c_name), *style->style);
-    return Py_BuildValue("");
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL)
+        return NULL;
+    PyObject* loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    Py_DECREF(asyncio);
+    if (loop == NULL)
+        return NULL;
+    PyObject* future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (future == NULL) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+
+    // the task holds references to the map, loop and future until it has
+    // handed over the result
+    Py_INCREF(themap);
+    Py_INCREF(future);
+    std::vector<WorkerPool::Task> tasks;
+    tasks.push_back([themap, loop, future, format](mapnik::image_rgba8& image) {
+        bool ok = true;
+        std::string data;
+        try {
+            with_map_read_locked(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+                data = render_to_string(map, view, format, image);
+            });
+        } catch (const std::exception& ex) {
+            ok = false;
+            data = ex.what();
+        }
+
+        if (!Py_IsInitialized())
+            return;
+
+        PyGILState_STATE gstate = PyGILState_Ensure();
+        PyObject* value = ok ? PyBytes_FromStringAndSize(data.data(), data.size())
+                             : PyUnicode_DecodeUTF8(data.data(), data.size(), "replace");
+        PyObject* ret = PyObject_CallMethod(loop, "call_soon_threadsafe", "OOOO",
+                                            resolve_future_func, future,
+                                            ok ? Py_True : Py_False, value);
+        if (ret == NULL)
+            PyErr_Clear(); // the loop has been closed, so nobody is waiting
+        Py_XDECREF(ret);
+        Py_XDECREF(value);
+        Py_DECREF(future);
+        Py_DECREF(loop);
+        Py_DECREF((PyObject*) themap);
+        PyGILState_Release(gstate);
+    });
+    async_pool->submit(tasks);
+
+    return future;
 }
 
 static PyObject *
-Map_set_background(MapnikMap *self, PyObject *color)
+mapnik_render_into(PyObject *self, PyObject *args)
 {
-    if (!PyObject_IsInstance(color, (PyObject*) &ColorType)) {
-        PyErr_SetString(MapnikError, "set_background requires a color object");
+    const MapnikMap* themap;
+    Py_buffer buffer;
+
+    if (!PyArg_ParseTuple(args, "Ow*", &themap, &buffer))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(MapnikError, "render_into requires a map object");
+        return NULL;
+    }
+    if (!PyBuffer_IsContiguous(&buffer, 'C')) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(MapnikError, "buffer must be contiguous and hold width * height * 4 bytes");
         return NULL;
     }
 
-    MapnikColor* ourcolor = (MapnikColor*) color;
-    self->map->set_background(*ourcolor->color);
+    // the image wraps the buffer without copying or owning it, so agg
+    // renders straight into the caller's memory
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        if (buffer.len != (Py_ssize_t) view.width() * view.height() * 4)
+            throw std::runtime_error("buffer must be contiguous and hold width * height * 4 bytes");
+        mapnik::image_rgba8 image(view.width(), view.height(), (unsigned char*) buffer.buf);
+        render_request(map, view, image);
+    });
+    PyBuffer_Release(&buffer);
+    if (!ok)
+        return NULL;
+
     return Py_BuildValue("");
 }
 
 static PyObject *
-Map_get_srs(MapnikMap *self, PyObject *Py_UNUSED(ignored))
+mapnik_render_mvt(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    const char* c_srs = self->map->srs().c_str();
-    return Py_BuildValue("s", c_srs);
+    const MapnikMap* themap;
+    int z, x, y;
+    int extent = 4096, buffer = 64;
+
+    static char *kwlist[] = {"map", "z", "x", "y", "extent", "buffer", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oiii|ii", kwlist,
+                                     &themap, &z, &x, &y, &extent, &buffer))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_mvt requires a map object");
+        return NULL;
+    }
+    if (!check_tile(z, x, y))
+        return NULL;
+    if (extent < 1 || buffer < 0) {
+        PyErr_SetString(MapnikError, "extent must be positive, buffer non-negative");
+        return NULL;
+    }
+
+    std::string data;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        data = render_mvt(map, z, x, y, extent, buffer);
+    });
+    if (!ok)
+        return NULL;
+
+    return PyBytes_FromStringAndSize(data.data(), data.size());
 }
 
 static PyObject *
-Map_set_srs(MapnikMap *self, PyObject* args)
+mapnik_render_tile(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    char *c_srs;
-    if (!PyArg_ParseTuple(args, "s", &c_srs))
+    const MapnikMap* themap;
+    int z, x, y;
+    int metatile = 1, buffer = 0, size = 256;
+    ImageFormat format("png");
+    PyObject* detector = NULL;
+    int detect_empty = 0;
+
+    static char *kwlist[] = {"map", "z", "x", "y", "metatile", "buffer",
+                             "format", "size", "detector", "detect_empty", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oiii|iiO&iOp", kwlist,
+                                     &themap, &z, &x, &y, &metatile,
+                                     &buffer, image_format_converter, &format,
+                                     &size, &detector, &detect_empty))
         return NULL;
 
-    self->map->set_srs(std::string(c_srs));
-    return Py_BuildValue("");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_tile requires a map object");
+        return NULL;
+    }
+    if (!check_tile(z, x, y))
+        return NULL;
+    if (!check_metatile(metatile, size, buffer))
+        return NULL;
+
+    Metatile meta = metatile_for(z, x, y, metatile);
+    if (!check_detector(detector, format))
+        return NULL;
+
+    LabelBoxes* labels = detector_labels(detector);
+    std::vector<std::string> tiles;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        if (detect_empty && metatile_is_empty(map, meta, size, buffer))
+            tiles.assign(meta.rows * meta.columns, blank_tile(map, size, format));
+        else if (labels)
+            tiles = render_metatile_with_labels(map, meta, size, buffer, format, *labels);
+        else
+            tiles = render_metatile(map, meta, size, buffer, format);
+    });
+    if (!ok)
+        return NULL;
+
+    PyObject* result = PyDict_New();
+    for (int row = 0; row < meta.rows; row++) {
+        for (int col = 0; col < meta.columns; col++) {
+            std::string const& tile = tiles[row * meta.columns + col];
+            PyObject* key = Py_BuildValue("(ii)", meta.x + col, meta.y + row);
+            PyObject* value = PyBytes_FromStringAndSize(tile.data(), tile.size());
+            PyDict_SetItem(result, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+    }
+    return result;
 }
 
 static PyObject *
-Map_zoom_to_box(MapnikMap *self, PyObject *box)
+mapnik_tile_is_empty(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    if (!PyObject_IsInstance(box, (PyObject*) &BoxType)) {
-        PyErr_SetString(MapnikError, "zoom_to_box requires a box object");
+    const MapnikMap* themap;
+    int z, x, y;
+    int metatile = 1, buffer = 0, size = 256;
+
+    static char *kwlist[] = {"map", "z", "x", "y", "metatile", "buffer",
+                             "size", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oiii|iii", kwlist,
+                                     &themap, &z, &x, &y, &metatile,
+                                     &buffer, &size))
+        return NULL;
+
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "tile_is_empty requires a map object");
         return NULL;
     }
+    if (!check_tile(z, x, y))
+        return NULL;
+    if (!check_metatile(metatile, size, buffer))
+        return NULL;
 
-    MapnikBox2d* ourbox = (MapnikBox2d*) box;
-    self->map->zoom_to_box(*ourbox->box);
-    return Py_BuildValue("");
+    Metatile meta = metatile_for(z, x, y, metatile);
+    bool empty = false;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        empty = metatile_is_empty(map, meta, size, buffer);
+    });
+    if (!ok)
+        return NULL;
+
+    return PyBool_FromLong(empty);
 }
 
-static PyMethodDef Map_methods[] = {
-    {"add_layer", (PyCFunction) Map_add_layer, METH_VARARGS,
-     "Add a layer to the map"
-    },
-    {"add_style", (PyCFunction) Map_add_style, METH_VARARGS,
-     "Add a named style to the map"
-    },
-    {"get_srs", (PyCFunction) Map_get_srs, METH_NOARGS,
-     "Return the map's projection"
-    },
-    {"set_background", (PyCFunction) Map_set_background, METH_O,
-     "Set background color for the map"
-    },
-    {"set_srs", (PyCFunction) Map_set_srs, METH_VARARGS,
-     "Set map projection"
-    },
-    {"zoom_to_box", (PyCFunction) Map_zoom_to_box, METH_O,
-     "Zoom the map to show the specified rectangle"
-    },
-    {NULL}  /* Sentinel */
-};
+static PyObject *
+mapnik_render_to_fileobj(PyObject *self, PyObject *args)
+{
+    ImageFormat format;
+    const MapnikMap* themap;
+    PyObject* file;
 
-static PyTypeObject MapType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "pymapnik3.Map",
-    .tp_doc = PyDoc_STR("Map objects"),
-    .tp_basicsize = sizeof(MapnikMap),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Map_init,
-    .tp_dealloc = (destructor) Map_dealloc,
-    .tp_members = Map_members,
-    .tp_methods = Map_methods,
-};
+    if (!PyArg_ParseTuple(args, "OO&O", &themap, image_format_converter, &format, &file))
+        return NULL;
 
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_to_fileobj requires a map object");
+        return NULL;
+    }
+    if (!PyObject_HasAttrString(file, "write")) {
+        PyErr_SetString(MapnikError, "render_to_fileobj requires an object with a write method");
+        return NULL;
+    }
 
-// ===========================================================================
-// FUNCTIONS
+    // the image is encoded into memory while the map is locked, and only
+    // written out once the locks are released
+    std::ostringstream stream;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        render_to_stream(map, view, format, stream);
+    });
+    if (!ok)
+        return NULL;
+
+    if (!write_in_chunks(file, stream.str()))
+        return NULL;
+
+    return Py_BuildValue("");
+}
 
 static PyObject *
-mapnik_parse_from_geojson(PyObject *self, PyObject *args)
+mapnik_render_to_buffer(PyObject *self, PyObject *args)
 {
-    char* c_json;
-    PyObject* c_ctx;
-    if (!PyArg_ParseTuple(args, "sO", &c_json, &c_ctx))
+    ImageFormat format;
+    const MapnikMap* themap;
+    Py_buffer buffer;
+
+    if (!PyArg_ParseTuple(args, "OO&w*", &themap, image_format_converter, &format, &buffer))
         return NULL;
 
-    if (!PyObject_IsInstance(c_ctx, (PyObject*) &ContextType)) {
-        PyErr_SetString(MapnikError, "second argument to from_geojson must be context object");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(MapnikError, "render_to_buffer requires a map object");
         return NULL;
     }
 
-    MapnikContext* ctx = (MapnikContext*) c_ctx;
-    mapnik::feature_ptr feature(mapnik::feature_factory::create(ctx->context, 1));
-    if (!mapnik::json::from_geojson(std::string(c_json), *feature)) {
-        PyErr_SetString(MapnikError, "Failed to parse geojson feature");
+    MemoryStreambuf streambuf((char*) buffer.buf, buffer.len);
+    std::ostream stream(&streambuf);
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        render_to_stream(map, view, format, stream);
+    });
+    PyBuffer_Release(&buffer);
+    if (!ok)
         return NULL;
-    }
 
-    PyObject *argList = Py_BuildValue("()");
-    MapnikFeature* featureobj = (MapnikFeature*) PyObject_CallObject((PyObject *) &FeatureType, argList);
-    Py_DECREF(argList);
+    if (!stream.good()) {
+        PyErr_SetString(MapnikError, "buffer too small for rendered image");
+        return NULL;
+    }
 
-    featureobj->feature = feature;
-    PyObject* pyfeature = (PyObject*) featureobj;
-    return Py_BuildValue("O", pyfeature);
+    return Py_BuildValue("n", (Py_ssize_t) streambuf.written());
 }
 
 static PyObject *
-mapnik_register_datasources(PyObject *self, PyObject *args)
+mapnik_render_with_stats(PyObject *self, PyObject *args)
 {
-    const char *path;
-    if (!PyArg_ParseTuple(args, "s", &path))
+    ImageFormat format("png");
+    const MapnikMap* themap;
+
+    if (!PyArg_ParseTuple(args, "O|O&", &themap, image_format_converter, &format))
         return NULL;
 
-    mapnik::datasource_cache::instance().register_datasources(std::string(path));
-    return Py_BuildValue("");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "render_with_stats requires a map object");
+        return NULL;
+    }
+
+    std::string data;
+    std::vector<LayerStats> stats;
+    double render_time, encode_time;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        mapnik::image_rgba8 local;
+        mapnik::image_rgba8& image = scratch_image(local);
+
+        auto start = std::chrono::steady_clock::now();
+        stats = render_with_stats(map, view, image);
+        render_time = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        data = encode_to_string(image, format);
+        encode_time = seconds_since(start);
+    });
+    if (!ok)
+        return NULL;
+
+    PyObject* layers = PyList_New(0);
+    for (LayerStats const& layer : stats) {
+        PyObject* styles = PyList_New(0);
+        double layer_time = 0;
+        std::size_t fetched = 0, rendered = 0, symbolizers = 0;
+        for (StyleStats const& style : layer.styles) {
+            PyObject* entry = Py_BuildValue("{s:s,s:d,s:n,s:n,s:n}",
+                                            "name", style.name.c_str(),
+                                            "time", style.time,
+                                            "features_fetched", (Py_ssize_t) style.fetched,
+                                            "features_rendered", (Py_ssize_t) style.rendered,
+                                            "symbolizers_applied", (Py_ssize_t) style.symbolizers);
+            PyList_Append(styles, entry);
+            Py_DECREF(entry);
+            layer_time += style.time;
+            fetched += style.fetched;
+            rendered += style.rendered;
+            symbolizers += style.symbolizers;
+        }
+
+        PyObject* entry = Py_BuildValue("{s:s,s:d,s:n,s:n,s:n,s:N}",
+                                        "name", layer.name.c_str(),
+                                        "time", layer_time,
+                                        "features_fetched", (Py_ssize_t) fetched,
+                                        "features_rendered", (Py_ssize_t) rendered,
+                                        "symbolizers_applied", (Py_ssize_t) symbolizers,
+                                        "styles", styles);
+        PyList_Append(layers, entry);
+        Py_DECREF(entry);
+    }
+
+    return Py_BuildValue("y#{s:d,s:d,s:N}", data.data(), (Py_ssize_t) data.size(),
+                         "render_time", render_time,
+                         "encode_time", encode_time,
+                         "layers", layers);
 }
 
 static PyObject *
-mapnik_register_font(PyObject *self, PyObject *args)
+mapnik_set_image_pool(PyObject *self, PyObject *args)
 {
-    const char *path;
-    if (!PyArg_ParseTuple(args, "s", &path))
+    int flag;
+    if (!PyArg_ParseTuple(args, "p", &flag))
         return NULL;
 
-    mapnik::freetype_engine::register_font(path);
+    image_pool_enabled = flag == 1;
     return Py_BuildValue("");
 }
 
 static PyObject *
-mapnik_render_to_file(PyObject *self, PyObject *args)
+mapnik_zoom_plan(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    const char *filename, *format;
     const MapnikMap* themap;
+    int minzoom, maxzoom;
+    int size = 256;
 
-    if (!PyArg_ParseTuple(args, "Oss", &themap, &filename, &format))
+    static char *kwlist[] = {"map", "minzoom", "maxzoom", "size", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii|i", kwlist,
+                                     &themap, &minzoom, &maxzoom, &size))
         return NULL;
 
-#ifdef HAVE_CAIRO
-    if (!strcmp(format, "svg") || !strcmp(format, "pdf")) {
-        mapnik::save_to_cairo_file(*themap->map, std::string(filename), std::string(format), 1.0);
-        return Py_BuildValue("");
+    if (!PyObject_IsInstance((PyObject*) themap, (PyObject*) &MapType)) {
+        PyErr_SetString(MapnikError, "zoom_plan requires a map object");
+        return NULL;
+    }
+    if (minzoom < 0 || maxzoom > 30 || minzoom > maxzoom || size < 1) {
+        PyErr_SetString(MapnikError, "zoom levels must be 0 to 30, size positive");
+        return NULL;
     }
-#endif
-
-    mapnik::image_rgba8 image = mapnik::image_rgba8(themap->map->width(), themap->map->height());
-
-    mapnik::agg_renderer<mapnik::image_rgba8> ren(*themap->map, image);
-    ren.apply();
 
-    mapnik::save_to_file(image, std::string(filename), std::string(format));
+    std::vector<std::vector<std::pair<std::string, std::vector<std::string>>>> plans;
+    bool ok = render_without_gil(themap, [&](mapnik::Map const& map, mapnik::request const& view) {
+        for (int z = minzoom; z <= maxzoom; z++)
+            plans.push_back(active_styles(map, zoom_scale_denominator(z, size)));
+    });
+    if (!ok)
+        return NULL;
 
-    return Py_BuildValue("");
+    PyObject* result = PyDict_New();
+    for (int z = minzoom; z <= maxzoom; z++) {
+        auto const& plan = plans[z - minzoom];
+        PyObject* layers = PyList_New(plan.size());
+        for (std::size_t ix = 0; ix < plan.size(); ix++) {
+            PyObject* styles = PyList_New(plan[ix].second.size());
+            for (std::size_t jx = 0; jx < plan[ix].second.size(); jx++)
+                PyList_SET_ITEM(styles, jx, Py_BuildValue("s", plan[ix].second[jx].c_str()));
+            PyList_SET_ITEM(layers, ix, Py_BuildValue("(sN)", plan[ix].first.c_str(), styles));
+        }
+        PyObject* key = Py_BuildValue("i", z);
+        PyDict_SetItem(result, key, layers);
+        Py_DECREF(key);
+        Py_DECREF(layers);
+    }
+    return result;
 }
 
 static PyMethodDef MapnikMethods[] = {
+    {"clear_expression_cache", (PyCFunction) mapnik_clear_expression_cache, METH_NOARGS,
+     "Forget all cached expressions and reset the cache statistics"},
+    {"clear_map_cache", (PyCFunction) mapnik_clear_map_cache, METH_NOARGS,
+     "Forget all stylesheets parsed by load_map"},
+    {"expression_cache_stats", (PyCFunction) mapnik_expression_cache_stats, METH_NOARGS,
+     "Return a dict with the size, hits and misses of the expression cache"},
+    {"load_map", (PyCFunction) mapnik_load_map, METH_VARARGS | METH_KEYWORDS,
+     "Load a Mapnik XML stylesheet, from a file or a string, into a map"},
     {"parse_from_geojson", (PyCFunction) mapnik_parse_from_geojson, METH_VARARGS,
      "Build feature from geojson string"
     },
@@ -1994,8 +7394,34 @@ static PyMethodDef MapnikMethods[] = {
      "Tell mapnik where to find datasource plugins"},
     {"register_font",  mapnik_register_font, METH_VARARGS,
      "Import a font file into mapnik"},
+    {"render",  mapnik_render, METH_VARARGS,
+     "Render a map into an image object."},
+    {"render_async",  mapnik_render_async, METH_VARARGS,
+     "Render a map on a native thread, returning an asyncio future with the encoded image."},
+    {"render_dirty", (PyCFunction) mapnik_render_dirty, METH_VARARGS | METH_KEYWORDS,
+     "Re-render the parts of an image covered by a list of Box2d, returning the number of pixels rendered"},
+    {"render_into",  mapnik_render_into, METH_VARARGS,
+     "Render a map into a writable buffer of width * height * 4 bytes of premultiplied RGBA."},
+    {"render_mvt", (PyCFunction) mapnik_render_mvt, METH_VARARGS | METH_KEYWORDS,
+     "Return the web mercator tile (z, x, y) as a Mapbox vector tile"},
+    {"render_tile", (PyCFunction) mapnik_render_tile, METH_VARARGS | METH_KEYWORDS,
+     "Render the web mercator metatile containing tile (z, x, y), returning a dict of (x, y) -> encoded tile"},
+    {"render_to_buffer",  mapnik_render_to_buffer, METH_VARARGS,
+     "Render a map into a writable buffer, returning the number of bytes written."},
+    {"render_to_bytes", (PyCFunction) mapnik_render_to_bytes, METH_VARARGS | METH_KEYWORDS,
+     "Render a map to a bytes object."},
     {"render_to_file",  mapnik_render_to_file, METH_VARARGS,
      "Render a map to file."},
+    {"render_to_fileobj",  mapnik_render_to_fileobj, METH_VARARGS,
+     "Render a map, writing the encoded image to a file-like object."},
+    {"render_with_stats",  mapnik_render_with_stats, METH_VARARGS,
+     "Render a map, returning the encoded image and a dict of timings and counts per layer and style."},
+    {"set_image_pool",  mapnik_set_image_pool, METH_VARARGS,
+     "Turn on or off reuse of a per-thread image for renders"},
+    {"tile_is_empty", (PyCFunction) mapnik_tile_is_empty, METH_VARARGS | METH_KEYWORDS,
+     "Return True if no layer has anything inside the (buffered) metatile containing tile (z, x, y)"},
+    {"zoom_plan", (PyCFunction) mapnik_zoom_plan, METH_VARARGS | METH_KEYWORDS,
+     "Return a dict of zoom level -> list of (layer name, [style names]) that would be rendered"},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
@@ -2029,6 +7455,14 @@ PyInit_pymapnik3(void)
         return NULL;
     if (PyType_Ready(&GeoJsonType) < 0)
         return NULL;
+    if (PyType_Ready(&ImageType) < 0)
+        return NULL;
+    if (PyType_Ready(&PaletteType) < 0)
+        return NULL;
+    if (PyType_Ready(&EncoderType) < 0)
+        return NULL;
+    if (PyType_Ready(&LabelCollisionDetectorType) < 0)
+        return NULL;
     if (PyType_Ready(&LayerType) < 0)
         return NULL;
     if (PyType_Ready(&LineSymbolizerType) < 0)
@@ -2049,6 +7483,8 @@ PyInit_pymapnik3(void)
         return NULL;
     if (PyType_Ready(&RasterSymbolizerType) < 0)
         return NULL;
+    if (PyType_Ready(&RenderPoolType) < 0)
+        return NULL;
     if (PyType_Ready(&RuleType) < 0)
         return NULL;
     if (PyType_Ready(&ShapefileType) < 0)
@@ -2122,6 +7558,34 @@ PyInit_pymapnik3(void)
         return NULL;
     }
 
+    Py_INCREF(&ImageType);
+    if (PyModule_AddObject(m, "Image", (PyObject *) &ImageType) < 0) {
+        Py_DECREF(&ImageType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&PaletteType);
+    if (PyModule_AddObject(m, "Palette", (PyObject *) &PaletteType) < 0) {
+        Py_DECREF(&PaletteType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&EncoderType);
+    if (PyModule_AddObject(m, "Encoder", (PyObject *) &EncoderType) < 0) {
+        Py_DECREF(&EncoderType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&LabelCollisionDetectorType);
+    if (PyModule_AddObject(m, "LabelCollisionDetector", (PyObject *) &LabelCollisionDetectorType) < 0) {
+        Py_DECREF(&LabelCollisionDetectorType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
     Py_INCREF(&LayerType);
     if (PyModule_AddObject(m, "Layer", (PyObject *) &LayerType) < 0) {
         Py_DECREF(&LayerType);
@@ -2192,6 +7656,13 @@ PyInit_pymapnik3(void)
         return NULL;
     }
 
+    Py_INCREF(&RenderPoolType);
+    if (PyModule_AddObject(m, "RenderPool", (PyObject *) &RenderPoolType) < 0) {
+        Py_DECREF(&RenderPoolType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
     Py_INCREF(&RuleType);
     if (PyModule_AddObject(m, "Rule", (PyObject *) &RuleType) < 0) {
         Py_DECREF(&RuleType);